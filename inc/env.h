@@ -44,8 +44,43 @@ enum {
 /* Special environment types */
 enum env_type {
     ENV_TYPE_USER = 0,
+    ENV_TYPE_TEMPLATE,      /* Never runs, cloned by env_create */
 };
 
+/* Memory use of an environment, kept up to date by the kernel and
+ * readable by the user through envs[] at USER_ENVS.
+ */
+struct env_mem {
+    uint64_t rss_pages;     /* 4K pages mapped */
+    uint64_t rss_huge;      /* 2M pages mapped */
+    uint64_t pt_pages;      /* Page table pages, including the PML4 */
+    uint32_t vmas;          /* VMAs in use */
+    uint64_t minor_faults;  /* Page faults served from memory */
+    uint64_t populates;     /* MAP_POPULATE and MADV_WILLNEED requests */
+};
+
+/* Resources limited by struct mem_limit, in pages */
+enum {
+    MEM_RSS = 0,        /* Pages mapped, a 2M page counts as 512 */
+    MEM_PT,             /* Page table pages */
+    MEM_NRES
+};
+
+/* Limits on the memory use of an environment or a group of them, 0 is
+ * unlimited. Going over the soft limit makes the environment drop pages
+ * it can fault back in, the hard limit is never exceeded.
+ */
+struct mem_limit {
+    uint64_t soft;
+    uint64_t hard;
+};
+
+/* Memory groups: limits shared by the environments in a group,
+ * group 0 means no group */
+#define MEM_NGROUPS     16
+
+struct startup_profile;
+
 struct env {
     struct int_frame env_frame; /* Saved registers */
     struct env *env_link;       /* Next free env */
@@ -60,15 +95,78 @@ struct env {
 
     // Linked list of vma's and current amount of vma's (128 max)
     struct vma *vma;
+    struct vma *env_vmas;       /* The 128 VMAs the list is made of */
+
+    /* Memory accounting */
+    struct env_mem env_mem;
+    struct mem_limit env_limit[MEM_NRES];
+    uint32_t env_group;         /* Memory group, inherited from the parent */
+
+    /* Page fault upcall, run on the exception stack below UXSTACK_TOP */
+    void *env_pgfault_upcall;
+
+    /* Scheduling (see kern/sched.c) */
+    struct env *env_rq_next;    /* Runqueue links */
+    struct env *env_rq_prev;
+    uint32_t env_queued;        /* Whether on a runqueue */
+    uint32_t env_prio;          /* Priority level, 0 is the highest */
+    uint32_t env_slice;         /* Timer ticks left of the timeslice */
+    uint64_t env_cpu_ticks;     /* Timer ticks spent running */
+
+    /* Startup profile being recorded, until env_profile_end (TSC) */
+    struct startup_profile *env_profile;
+    uint64_t env_profile_end;
 };
 
 /* Anonymous VMAs are zero-initialized whereas binary VMAs
- * are filled-in from the ELF binary.
+ * are filled-in from the ELF binary. Stack VMAs are anonymous
+ * memory that grows down when a page below them is touched.
+ * Shared VMAs are anonymous memory whose frames are mapped by
+ * several environments (see sys_vma_share). The vDSO VMA holds
+ * the kernel data page of the environment (see kern/vdso.c).
  */
 enum {
     VMA_UNUSED,         // MATTHIJS: when to used unused?
     VMA_ANON,
     VMA_BINARY,
+    VMA_STACK,
+    VMA_SHARED,
+    VMA_VDSO,           // Kernel data page at USER_VDSO, read-only
+};
+
+/* Virtual Memory Area permissions */
+#define PERM_R	    0x0001
+#define PERM_W	    0x0002
+
+/* Virtual Memory Area flags */
+#define MAP_POPULATE    0x0001
+#define MAP_FIXED       0x0002
+#define MAP_SHARED      0x0004
+
+/* Flags for sys_vma_remap */
+#define MREMAP_MAYMOVE  0x0001
+
+/* Advice for sys_vma_advise */
+#define MADV_NORMAL         0   /* No special treatment */
+#define MADV_RANDOM         1   /* Expect random page references */
+#define MADV_SEQUENTIAL     2   /* Expect sequential page references */
+#define MADV_WILLNEED       3   /* Will need these pages, map them now */
+#define MADV_DONTNEED       4   /* Don't need these pages, drop them */
+#define MADV_HUGEPAGE       5   /* Back with huge pages where possible */
+#define MADV_NOHUGEPAGE     6   /* Never back with huge pages */
+#define MADV_MERGEABLE      7   /* Let identical pages be merged */
+#define MADV_UNMERGEABLE    8   /* Stop merging identical pages */
+#define MADV_USERFAULT      9   /* Deliver page faults to the upcall */
+#define MADV_NOUSERFAULT    10  /* Let the kernel handle page faults */
+
+/* Advice bits stored in vma->advice */
+enum {
+    VMA_ADV_RANDOM      = 1 << 0,
+    VMA_ADV_SEQUENTIAL  = 1 << 1,
+    VMA_ADV_HUGEPAGE    = 1 << 2,
+    VMA_ADV_NOHUGEPAGE  = 1 << 3,
+    VMA_ADV_MERGEABLE   = 1 << 4,
+    VMA_ADV_USERFAULT   = 1 << 5,
 };
 
 struct vma {
@@ -76,6 +174,16 @@ struct vma {
     void *va;           // Start virt addr (alligned)
     size_t len;         // Length of virt addr block (alligned)
     int perm;           // Permissions
+    int advice;         // VMA_ADV_* bits set by sys_vma_advise
+    int fa_max;         // Max pages mapped per fault (fault-around), 0 is off
+    int fa_pages;       // Current fault-around window, adapts to use
+    uintptr_t fa_start; // Window mapped around the last fault, used
+    uintptr_t fa_end;   // to check how much of it was accessed since
+    uintptr_t fa_fault;
+    uintptr_t ra_next;  // Sequential readahead: where the next fault is expected
+    int ra_pages;       // and the current window, 0 is off
+    uintptr_t stack_floor; // VMA_STACK: lowest address it may grow down to
+    uint64_t faults;    // Page faults resolved in this VMA
 
     /* LAB 4: You may add more fields here, if required. */
     struct vma *next;
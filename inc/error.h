@@ -17,6 +17,7 @@ enum {
     E_NO_FREE_VMA   = 8,
     E_IPC_NOT_RECV  = 9,    /* Attempt to send to env that is not recving */
     E_EOF           = 10,    /* Unexpected end of file */
+    E_QUOTA         = 11,   /* Memory limit of the environment reached */
     
     MAXERROR
 };
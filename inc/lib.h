@@ -37,6 +37,15 @@ extern const volatile physaddr_t *user_pml4, *user_pdpt, *user_pd, *user_pt;
 /* exit.c */
 void    exit(void);
 
+/* pgfault.c */
+void    set_pgfault_handler(void (*handler)(struct user_frame *uf));
+
+/* vdso.c */
+envid_t vdso_getenvid(void);
+const volatile struct env *vdso_thisenv(void);
+uint64_t vdso_tsc_hz(void);
+uint64_t vdso_uptime_ms(void);
+
 /* readline.c */
 char*   readline(const char *buf);
 
@@ -46,7 +55,17 @@ int sys_cgetc(void);
 envid_t sys_getenvid(void);
 int sys_env_destroy(envid_t);
 void *sys_vma_create(size_t, int, int);
+void *sys_vma_create_at(void *, size_t, int, int, size_t);
 int sys_vma_destroy(void *, size_t);
+int sys_vma_protect(void *, size_t, int);
+int sys_vma_advise(void *, size_t, int);
+int sys_vma_fault_around(void *, size_t, int);
+void *sys_vma_remap(void *, size_t, size_t, int);
+int sys_vma_share(envid_t, void *, size_t, int);
+int sys_mem_limit(envid_t, int, size_t, size_t);
+int sys_mem_group(envid_t, uint32_t);
+int sys_mem_group_limit(uint32_t, int, size_t, size_t);
+int sys_env_set_pgfault_upcall(envid_t, void *);
 void    sys_yield(void);
 int     sys_wait(envid_t);
 envid_t sys_fork(void);
@@ -65,11 +84,4 @@ envid_t fork(void);
 #define O_EXCL      0x0400      /* error if already exists */
 #define O_MKDIR     0x0800      /* create directory, not regular file */
 
-/* Virtual Memory Area permissions */
-#define PERM_R	    0x0001
-#define PERM_W	    0x0002
-
-/* Virtual Memory Area flags */
-#define MAP_POPULATE    0x0001
-
 #endif  /* !JOS_INC_LIB_H */
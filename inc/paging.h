@@ -21,9 +21,11 @@ struct page_info {
     /* pp_ref is the count of pointers (usually in page table entries)
      * to this page, for pages allocated using page_alloc.
      * Pages allocated at boot time using pmap.c's
-     * boot_alloc do not have valid reference count fields. */
+     * boot_alloc do not have valid reference count fields.
+     * Shared pages like the zero page can be mapped very often,
+     * hence 32 bits. */
+    uint32_t pp_ref;
     uint16_t is_huge;
-    uint16_t pp_ref;
 
     /* Is in the free list or not */
     uint16_t is_available;
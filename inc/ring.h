@@ -0,0 +1,39 @@
+#ifndef JOS_INC_RING_H
+#define JOS_INC_RING_H
+
+#include <inc/types.h>
+
+/*
+ * Single-producer/single-consumer byte ring buffer, meant to be placed in
+ * memory shared between two environments (see MAP_SHARED and
+ * sys_vma_share). Only the producer writes 'head' and only the consumer
+ * writes 'tail', so no locks are needed. Both count bytes since the start
+ * and are taken modulo the size, which is a power of two. The ring holds
+ * no pointers, so it works wherever the memory is mapped.
+ */
+
+#define RING_MAGIC      0x676e6972  /* "ring" */
+#define RING_CACHELINE  64
+
+struct ring {
+    uint64_t magic;
+    uint64_t size;          // Capacity of data in bytes
+    uint8_t pad0[RING_CACHELINE - 2 * sizeof(uint64_t)];
+
+    // On their own cache lines, so producer and consumer don't share one
+    uint64_t head;          // Bytes written so far, by the producer
+    uint8_t pad1[RING_CACHELINE - sizeof(uint64_t)];
+    uint64_t tail;          // Bytes read so far, by the consumer
+    uint8_t pad2[RING_CACHELINE - sizeof(uint64_t)];
+
+    uint8_t data[];
+};
+
+struct ring *ring_init(void *mem, size_t len);
+struct ring *ring_attach(void *mem);
+size_t ring_write(struct ring *ring, const void *buf, size_t len);
+size_t ring_read(struct ring *ring, void *buf, size_t len);
+size_t ring_used(struct ring *ring);
+size_t ring_free(struct ring *ring);
+
+#endif /* !JOS_INC_RING_H */
@@ -0,0 +1,39 @@
+#ifndef JOS_INC_STATS_H
+#define JOS_INC_STATS_H
+
+#include <inc/types.h>
+
+/*
+ * Statistics kept by the kernel and mapped read-only for the user at
+ * USER_STATS. Page fault latencies are measured in TSC cycles, from the
+ * start of page_fault_handler until the fault is resolved (or the
+ * environment is about to be destroyed), and kept in log2 histograms
+ * per CPU and per kind of fault: bucket i counts faults that took
+ * [2^i, 2^(i+1)) cycles.
+ */
+
+/* Kinds of page faults */
+enum {
+    FAULT_ANON = 0,     /* User fault on anonymous, stack or shared memory */
+    FAULT_BINARY,       /* User fault on a binary VMA */
+    FAULT_COW,          /* User write to a copy-on-write page */
+    FAULT_KERNEL,       /* Kernel access to user memory */
+    FAULT_UPCALL,       /* Delivered to the page fault upcall */
+    FAULT_FATAL,        /* Unresolved, the environment is destroyed */
+    FAULT_NKINDS
+};
+
+#define STATS_NCPU          8
+#define STATS_HIST_BUCKETS  32
+
+struct fault_stats {
+    uint64_t count[FAULT_NKINDS];
+    uint64_t cycles[FAULT_NKINDS];     /* Total, for the mean */
+    uint64_t hist[FAULT_NKINDS][STATS_HIST_BUCKETS];
+};
+
+struct kern_stats {
+    struct fault_stats faults[STATS_NCPU];  /* Indexed by CPU id */
+};
+
+#endif /* !JOS_INC_STATS_H */
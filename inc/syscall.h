@@ -8,5 +8,16 @@ enum {
     SYS_env_destroy,
     SYS_vma_create,
     SYS_vma_destroy,
+    SYS_vma_protect,
+    SYS_vma_advise,
+    SYS_vma_fault_around,
+    SYS_vma_remap,
+    SYS_vma_share,
+    SYS_mem_limit,
+    SYS_mem_group,
+    SYS_mem_group_limit,
+    SYS_env_set_pgfault_upcall,
+    SYS_fork,
+    SYS_yield,
     NSYSCALLS
 };
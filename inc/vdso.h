@@ -0,0 +1,31 @@
+#ifndef JOS_INC_VDSO_H
+#define JOS_INC_VDSO_H
+
+#include <inc/types.h>
+#include <inc/env.h>
+#include <inc/stats.h>
+
+/*
+ * Kernel data mapped read-only into every environment, so that queries
+ * about the kernel state are plain loads instead of system calls (see
+ * lib/vdso.c). The global part is shared by all environments at
+ * USER_KDATA, the part of an environment is its own page at USER_VDSO.
+ */
+
+struct vdso_global {
+    uint64_t tsc_hz;        /* TSC cycles per second, 0 if unknown */
+    uint64_t boot_tsc;      /* TSC when the kernel was done booting */
+    uint64_t env_runs;      /* Environments run so far */
+    uint64_t env_allocs;    /* Environments allocated so far */
+    uint64_t env_frees;     /* Environments freed so far */
+};
+
+struct vdso_env {
+    envid_t env_id;
+    envid_t env_parent_id;
+    const volatile struct env *env;             /* This env in envs */
+    const volatile struct vdso_global *global;  /* At USER_KDATA */
+    const volatile struct kern_stats *stats;    /* At USER_STATS */
+};
+
+#endif /* !JOS_INC_VDSO_H */
@@ -1,6 +1,7 @@
 #pragma once
 
 #define CR0_PM     (1 << 0)
+#define CR0_WP     (1 << 16)
 #define CR0_PAGING (1 << 31)
 
 #define CR4_PAE (1 << 5)
@@ -85,6 +86,18 @@ static inline void *read_rsp(void)
     return ret;
 }
 
+static inline uint64_t read_cr0(void)
+{
+    uint64_t ret;
+    asm volatile("movq %%cr0, %0" : "=r" (ret));
+    return ret;
+}
+
+static inline void write_cr0(uint64_t val)
+{
+    asm volatile("movq %0, %%cr0" :: "r" (val));
+}
+
 static inline void *read_cr2(void)
 {
     void *ret;
@@ -92,6 +105,13 @@ static inline void *read_cr2(void)
     return ret;
 }
 
+static inline uint64_t read_cr3(void)
+{
+    uint64_t ret;
+    asm volatile("movq %%cr3, %0" : "=r" (ret));
+    return ret;
+}
+
 static inline uint8_t inb(uint16_t port)
 {
     uint8_t data;
@@ -196,9 +216,9 @@ static inline void outsl(uint16_t port, const void *addr, size_t n)
 
 static inline uint64_t read_tsc(void)
 {
-    uint64_t ret;
-    asm volatile("rdtsc" : "=A" (ret));
-    return ret;
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
 }
 
 static inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval)
@@ -44,6 +44,9 @@
 #define IDT_INT_GATE32 IDT_GATE(0xE)
 #define IDT_TRAP_GATE32 IDT_GATE(0xF)
 
+/* Bytes below rsp that user code may use without moving rsp. */
+#define USER_RED_ZONE 128
+
 #ifndef __ASSEMBLER__
 #include <inc/x86-64/types.h>
 
@@ -68,6 +71,17 @@ struct int_frame {
     uint64_t rip, cs, rflags, rsp, ss;
 };
 
+/* Pushed on the user exception stack when a page fault is delivered to
+ * the page fault upcall (see sys_env_set_pgfault_upcall). The offsets are
+ * used by lib/pfentry.S. */
+struct user_frame {
+    uint64_t fault_va;
+    uint64_t err_code;
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rdi, rsi, rbp, rbx, rdx, rcx, rax;
+    uint64_t rip, rflags, rsp;
+};
+
 static inline void set_idt_entry(struct idt_entry *entry, void *offset,
     unsigned flags, uint16_t sel)
 {
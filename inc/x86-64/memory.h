@@ -45,6 +45,12 @@
 /* User pages (read-only). */
 #define USER_PAGES (USER_LIM - PDPT_SPAN)
 
+/* Kernel statistics (read-only), in the last 2MB of the user pages. */
+#define USER_STATS (USER_LIM - PAGE_TABLE_SPAN)
+
+/* Global kernel data (read-only), the last page of the statistics block. */
+#define USER_KDATA (USER_LIM - PAGE_SIZE)
+
 /* User environments (read-only). */
 #define USER_ENVS (USER_PAGES - PDPT_SPAN)
 
@@ -56,6 +62,15 @@
 #define UXSTACK_TOP USER_TOP
 #define USTACK_TOP (UXSTACK_TOP - 2 * PAGE_SIZE)
 
+/* Kernel data of the environment (read-only), between the user stack and
+ * the user exception stack. */
+#define USER_VDSO USTACK_TOP
+
+/* The user stack may grow down to USTACK_TOP - USTACK_SIZE, and the
+ * USTACK_GUARD bytes below that are kept free. */
+#define USTACK_SIZE (2048 * PAGE_SIZE)
+#define USTACK_GUARD (256 * PAGE_SIZE)
+
 /* Used for temporary page mappings. Typed as a void pointer as a convenience.
  */
 #define UTEMP ((void *)PAGE_SIZE)
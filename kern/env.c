@@ -12,8 +12,11 @@
 #include <kern/env.h>
 #include <kern/idt.h>
 #include <kern/pmap.h>
+#include <kern/profile.h>
+#include <kern/sched.h>
 #include <kern/monitor.h>
 #include <kern/syscall.h>
+#include <kern/vdso.h>
 
 #include <kern/vma.h>
 
@@ -23,6 +26,21 @@ static struct env *env_free_list;   /* Free environment list */
 
 #define ENVGENSHIFT 12      /* >= LOGNENV */
 
+static int env_setup_vma(struct env *e);
+void env_free_page_tables(struct page_table *page_table, size_t depth);
+
+/* Address spaces of freed envs, cleaned and ready for env_alloc to pick up
+ * (see env_setup_vm and env_release_vm). */
+static struct page_table *env_pml4_pool[ENV_PML4_POOL];
+static size_t env_pml4_pooled;
+
+/* Templates: per embedded binary, a never run env with its VMAs and its
+ * read-only pages set up, new instances are cloned from (see env_create). */
+static struct env_template {
+    uint8_t *binary;                /* Key, NULL if the slot is free */
+    envid_t env_id;
+} env_templates[ENV_TEMPLATES];
+
 /*
  * Converts an envid to an env pointer.
  * If checkperm is set, the specified environment must be either the
@@ -94,6 +112,8 @@ void env_init(void)
         e = &envs[i];
         e->env_id = 0;
         e->env_status = ENV_FREE;
+        e->env_queued = 0;
+        env_setup_vma(e);
         e->env_link = env_free_list;
         env_free_list = e;
     }
@@ -113,15 +133,29 @@ void env_init(void)
  */
 static int env_setup_vm(struct env *e)
 {
-    cprintf("[ENV SETUP VM] start\n");
-
+    struct page_table *pml4, *pdpt, *pd;
+    struct page_table *kern_pdpt, *kern_pd;
+    struct page_info *p[3];
+    physaddr_t *entry;
     int i;
-    struct page_info *p = NULL;
 
-    /* Allocate a page for the page directory */
-    if (!(p = page_alloc(ALLOC_ZERO)))
-        return -E_NO_MEM;
+    /* Take a recycled address space if there is one */
+    if (env_pml4_pooled > 0) {
+        e->env_pml4 = env_pml4_pool[--env_pml4_pooled];
+        e->env_mem.pt_pages = 3;
+        return 0;
+    }
 
+    /* Allocate a page for the page directory, and for the private tables
+     * of the last user PML4 slot */
+    for (i = 0; i < 3; i++) {
+        if (!(p[i] = page_alloc(ALLOC_ZERO))) {
+            while (i-- > 0)
+                page_decref(p[i]);
+            return -E_NO_MEM;
+        }
+        p[i]->pp_ref += 1;
+    }
 
     /*
      * Now, set e->env_pml4 and initialize the page directory.
@@ -141,40 +175,122 @@ static int env_setup_vm(struct env *e)
      */
 
     /* LAB 3: your code here. */
-    p->pp_ref += 1;
-    e->env_pml4 = (struct page_table *)KADDR(page2pa(p));
-
-    // The initial VA below UTOP is empty
-    for (i = 0; i < PML4_INDEX(USER_TOP); i++) {
-        e->env_pml4->entries[i] = 0;
-    }
+    pml4 = (struct page_table *)KADDR(page2pa(p[0]));
+    pdpt = (struct page_table *)KADDR(page2pa(p[1]));
+    pd = (struct page_table *)KADDR(page2pa(p[2]));
+    e->env_pml4 = pml4;
+    e->env_mem.pt_pages = 3;
 
     // The VA space of all envs is identical above UTOP
     // (we don't allocate any new pages, we use the existing structures)
     for (i = PML4_INDEX(USER_TOP); i < PAGE_TABLE_ENTRIES; i++) {
-        e->env_pml4->entries[i] = kern_pml4->entries[i];
+        pml4->entries[i] = kern_pml4->entries[i];
     }
 
+    /* The last user slot is shared with the pages, envs and VMAs images,
+     * and the user stack sits right below the envs, in the same 1GB as the
+     * VMA lists. Give the slot, and that 1GB, tables of their own that
+     * point to the kernel's tables for the kernel part, so the user part
+     * stays private. */
+    static_assert(PML4_INDEX(USER_VMAS) == PML4_INDEX(USER_TOP - 1));
+    entry = pml4->entries + PML4_INDEX(USER_TOP - 1);
+    kern_pdpt = (struct page_table *)KADDR(PAGE_ADDR(*entry));
+    memcpy(pdpt, kern_pdpt, PAGE_SIZE);
+    *entry = PADDR(pdpt) | (*entry & PAGE_MASK);
+
+    entry = pdpt->entries + PDPT_INDEX(USER_VMAS);
+    kern_pd = (struct page_table *)KADDR(PAGE_ADDR(*entry));
+    memcpy(pd, kern_pd, PAGE_SIZE);
+    *entry = PADDR(pd) | (*entry & PAGE_MASK);
+
     /* UVPT maps the env's own page table read-only.
      * Permissions: kernel R, user R */
-    e->env_pml4->entries[PML4_INDEX(USER_PML4)] =
-        PADDR(e->env_pml4) | PAGE_PRESENT | PAGE_USER | PAGE_NO_EXEC;
+    pml4->entries[PML4_INDEX(USER_PML4)] =
+        PADDR(pml4) | PAGE_PRESENT | PAGE_USER | PAGE_NO_EXEC;
 
-    cprintf("[ENV SETUP VM] end\n");
     return 0;
 }
 
+/*
+ * Frees the user part of an address space set up by env_setup_vm: the
+ * pages and tables mapped below USER_TOP, but not the kernel's tables the
+ * last user slot points to. The cleaned PML4 goes back to the pool, or
+ * is freed with its private tables if the pool is full.
+ */
+static void env_release_vm(struct page_table *pml4)
+{
+    struct page_table *pdpt, *pd, *kern_pdpt, *kern_pd;
+    physaddr_t *entry;
+    size_t i;
+
+    /* Whole user slots */
+    for (i = 0; i < PML4_INDEX(USER_TOP - 1); i++) {
+        entry = pml4->entries + i;
+        if (*entry & PAGE_PRESENT) {
+            env_free_page_tables(KADDR(PAGE_ADDR(*entry)), 2);
+            *entry = 0;
+        }
+    }
+
+    /* The last user slot, skipping whatever the kernel maps there */
+    pdpt = KADDR(PAGE_ADDR(pml4->entries[PML4_INDEX(USER_TOP - 1)]));
+    kern_pdpt = KADDR(PAGE_ADDR(kern_pml4->entries[PML4_INDEX(USER_TOP - 1)]));
+    for (i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        entry = pdpt->entries + i;
+        if ((*entry & PAGE_PRESENT) && !kern_pdpt->entries[i]) {
+            env_free_page_tables(KADDR(PAGE_ADDR(*entry)), 1);
+            *entry = 0;
+        }
+    }
+
+    pd = KADDR(PAGE_ADDR(pdpt->entries[PDPT_INDEX(USER_VMAS)]));
+    kern_pd = KADDR(PAGE_ADDR(kern_pdpt->entries[PDPT_INDEX(USER_VMAS)]));
+    for (i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        entry = pd->entries + i;
+        if (!(*entry & PAGE_PRESENT) || kern_pd->entries[i]) {
+            continue;
+        }
+        if (*entry & PAGE_HUGE) {
+            page_decref(pa2page(PAGE_ADDR(*entry)));
+        } else {
+            env_free_page_tables(KADDR(PAGE_ADDR(*entry)), 0);
+        }
+        *entry = 0;
+    }
+
+    if (env_pml4_pooled < ENV_PML4_POOL) {
+        env_pml4_pool[env_pml4_pooled++] = pml4;
+        return;
+    }
+
+    page_decref(pa2page(PADDR(pd)));
+    page_decref(pa2page(PADDR(pdpt)));
+    page_decref(pa2page(PADDR(pml4)));
+}
+
 // Init all the values in the vma structure
+// Done when the env is freed, so env_alloc finds it ready
 static int env_setup_vma(struct env *e) {
-    cprintf("[ENV SETUP VMA] start\n");
-    struct vma *vma_list = e->vma;
+    struct vma *vma_list = e->env_vmas;
     int j;
 
+    e->vma = vma_list;
+
     for (j = 0; j < 128; j++) {
         vma_list[j].type = VMA_UNUSED;       
         vma_list[j].va = NULL;
         vma_list[j].len = 0;  
         vma_list[j].perm = 0;    
+        vma_list[j].advice = 0;
+        vma_list[j].fa_max = 0;
+        vma_list[j].fa_pages = 0;
+        vma_list[j].fa_start = 0;
+        vma_list[j].fa_end = 0;
+        vma_list[j].fa_fault = 0;
+        vma_list[j].ra_next = 0;
+        vma_list[j].ra_pages = 0;
+        vma_list[j].stack_floor = 0;
+        vma_list[j].faults = 0;
         vma_list[j].mem_va = NULL;
         vma_list[j].mem_size = 0;
         vma_list[j].file_va = NULL;
@@ -183,7 +299,6 @@ static int env_setup_vma(struct env *e) {
         vma_list[j].prev = (j == 0) ? NULL : &vma_list[j-1];
     }
 
-    cprintf("[ENV SETUP VMA] end\n");
     return 0;
 }
 
@@ -197,7 +312,6 @@ static int env_setup_vma(struct env *e) {
  */
 int env_alloc(struct env **newenv_store, envid_t parent_id)
 {
-    cprintf("[ENV ALLOC] start\n");
     int32_t generation;
     int r;
     struct env *e;
@@ -205,14 +319,16 @@ int env_alloc(struct env **newenv_store, envid_t parent_id)
     if (!(e = env_free_list))
         return -E_NO_FREE_ENV;
 
+    memset(&e->env_mem, 0, sizeof(e->env_mem));
+    memset(e->env_limit, 0, sizeof(e->env_limit));
+    e->env_group = (curenv && curenv->env_id == parent_id) ? curenv->env_group : 0;
+    e->env_profile = NULL;
+    e->env_pgfault_upcall = NULL;
+
     /* Allocate and set up the page directory for this environment. */
     if ((r = env_setup_vm(e)) < 0)
         return r;
 
-    /* Set up list of VMAs for this environment. */
-    if ((r = env_setup_vma(e)) < 0)
-        return r;
-
     /* Generate an env_id for this environment. */
     generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
     if (generation <= 0)    /* Don't create a negative env_id. */
@@ -248,12 +364,30 @@ int env_alloc(struct env **newenv_store, envid_t parent_id)
     e->env_frame.cs = GDT_UCODE | 3;
     /* You will set e->env_frame.rip later. */
 
+    /* Run with interrupts enabled, so the timer can preempt it. */
+    e->env_frame.rflags = FLAGS_IF;
+
+    /* Map the kernel data page of the environment. */
+    if ((r = vdso_setup(e)) < 0) {
+        env_release_vm(e->env_pml4);
+        env_setup_vma(e);
+        e->env_pml4 = NULL;
+        e->env_status = ENV_FREE;
+        return r;
+    }
+
     /* Commit the allocation */
     env_free_list = e->env_link;
     *newenv_store = e;
+    vdso_global->env_allocs++;
+
+    /* New environments start at the highest priority. */
+    e->env_prio = 0;
+    e->env_slice = SCHED_QUANTUM(0);
+    e->env_cpu_ticks = 0;
+    sched_enqueue(e);
 
     cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
-    cprintf("[ENV ALLOC] end\n");
     return 0;
 }
 
@@ -347,13 +481,13 @@ static void load_icode(struct env *e, uint8_t *binary)
 
     /* LAB 3: your code here. */
 
-    /* load each program segment (ignores ph flags) */
+    /* load each program segment, writable only if its ph flags say so */
 
     cprintf("[LOAD ICODE] start\n");
 
     struct elf *eh = (struct elf *)binary;
     struct elf_proghdr *ph;
-    int i, number_of_segments;
+    int i, number_of_segments, perm;
 
     if (eh->e_magic != ELF_MAGIC)
         panic("Invalid ELF magic");
@@ -365,8 +499,12 @@ static void load_icode(struct env *e, uint8_t *binary)
         // Create a vma mapping for each program segment
         // Load binaries
         if (ph[i].p_type == ELF_PROG_LOAD) {
+            perm = PAGE_USER;
+            if (ph[i].p_flags & ELF_PROG_FLAG_WRITE)
+                perm |= PAGE_WRITE;
+
             if (vma_insert(e, VMA_BINARY, (void *)ph[i].p_va, 
-                ph[i].p_memsz, PAGE_WRITE | PAGE_USER, 
+                ph[i].p_memsz, perm, 
                 binary + ph[i].p_offset, ph[i].p_filesz) == NULL) {
                 panic("Couldn't create VMA for a program segment");
             }
@@ -385,15 +523,10 @@ static void load_icode(struct env *e, uint8_t *binary)
      * USTACKTOP - PGSIZE. */
 
     /* LAB 3: your code here. */
-    struct page_info *p = NULL;
-
-    /* Allocate a page for the page directory */
-    if (!(p = page_alloc(0)))
-        panic("Couldn't allocate memory for environment initial stack");
 
-    // Create a Vma for the user stack
-    vma_insert(e, VMA_ANON, (void *)(USTACK_TOP - PAGE_SIZE), PAGE_SIZE, 
-               PAGE_WRITE | PAGE_USER, NULL, 0);
+    // Create a Vma for the user stack, its pages are loaded on demand
+    if (vma_insert_stack(e, USTACK_TOP) == NULL)
+        panic("Couldn't create the environment initial stack");
 
     /* vmatest binary uses the following */
     /* 1. Map one RO page of VMA for UTEMP at virtual address UTEMP.
@@ -405,9 +538,64 @@ static void load_icode(struct env *e, uint8_t *binary)
     vma_insert(e, VMA_ANON, UTEMP+PAGE_SIZE, PAGE_SIZE, PAGE_WRITE | PAGE_USER,
             NULL, 0);
 
+    // Map the pages the binary touched right after its last start
+    profile_prefault(e, binary);
+
     cprintf("[LOAD ICODE] end\n");
 }
 
+/*
+ * Returns the template env of the binary, setting it up on first use: the
+ * binary is loaded with load_icode, and all pages of its read-only segments
+ * are mapped right away, so every instance shares them. The template never
+ * runs. Returns NULL if no template slot or env is left.
+ */
+static struct env *env_template(uint8_t *binary)
+{
+    struct env_template *slot = NULL;
+    struct env *t;
+    struct vma *vma;
+    uintptr_t va;
+    size_t i;
+
+    for (i = 0; i < ENV_TEMPLATES; i++) {
+        if (env_templates[i].binary == binary &&
+            envid2env(env_templates[i].env_id, &t, 0) == 0 &&
+            t->env_type == ENV_TYPE_TEMPLATE) {
+            return t;
+        }
+        if (slot == NULL && (env_templates[i].binary == NULL ||
+                             env_templates[i].binary == binary)) {
+            slot = &env_templates[i];
+        }
+    }
+
+    if (slot == NULL || env_alloc(&t, 0) < 0) {
+        return NULL;
+    }
+    t->env_type = ENV_TYPE_TEMPLATE;
+    t->env_status = ENV_NOT_RUNNABLE;
+    sched_dequeue(t);
+    load_icode(t, binary);
+
+    // Stop quietly when out of memory, instances fault the rest in
+    for (vma = t->vma; vma != NULL && vma->type != VMA_UNUSED; vma = vma->next) {
+        if (vma->type != VMA_BINARY || (vma->perm & PAGE_WRITE)) {
+            continue;
+        }
+        for (va = (uintptr_t) vma->va; va < (uintptr_t) vma->va + vma->len; va += PAGE_SIZE) {
+            if (page_lookup(t->env_pml4, (void *) va, NULL) == NULL &&
+                vma_load_page(t, vma, va, 0) < 0) {
+                break;
+            }
+        }
+    }
+
+    slot->binary = binary;
+    slot->env_id = t->env_id;
+    return t;
+}
+
 /*
  * Allocates a new env with env_alloc, loads the named elf binary into it with
  * load_icode, and sets its env_type.
@@ -419,13 +607,29 @@ void env_create(uint8_t *binary, enum env_type type)
 {
     /* LAB 3: your code here. */
     cprintf("[ENV CREATE] start\n");
-    struct env *e;
+    struct env *e, *t;
     int res;
 
+    t = env_template(binary);
+
     res = env_alloc(&e, 0);
     // Successs
     if (res == 0) {
-        load_icode(e, binary);
+        // Clone the template copy-on-write, skipping the ELF and the VMA
+        // setup, load the binary from scratch only if that is not possible
+        if (t != NULL && vma_fork(t, e) == 0) {
+            e->env_frame.rip = t->env_frame.rip;
+            profile_prefault(e, binary);
+        } else {
+            if (t != NULL) {
+                env_free(e);
+                if (env_alloc(&e, 0) < 0) {
+                    panic("Failed to allocate the environment");
+                }
+            }
+            load_icode(e, binary);
+        }
+        profile_start(e, binary);
         e->env_type = type;
     }
     else if (res == E_NO_MEM) {
@@ -457,7 +661,11 @@ void env_free_page_tables(struct page_table *page_table, size_t depth)
         if (!(*entry & PAGE_PRESENT))
             continue;
 
-        if (depth) {
+        if (depth == 1 && (*entry & PAGE_HUGE)) {
+            /* Free the huge page. */
+            page_decref(pa2page(PAGE_ADDR(*entry)));
+            *entry = 0;
+        } else if (depth) {
             /* Free the page table. */
             child = KADDR(PAGE_ADDR(*entry));
             env_free_page_tables(child, depth - 1);
@@ -483,15 +691,26 @@ void env_free(struct env *e)
     if (e == curenv)
         load_pml4((struct page_table *)PADDR(kern_pml4));
 
+    /* Take it off its runqueue. */
+    sched_dequeue(e);
+
     /* Note the environment's demise. */
     cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+    /* Record what the environment touched, if it is still profiled. */
+    profile_check(e, 1);
+
     /* Free the page tables. */
     static_assert(USER_TOP % PAGE_SIZE == 0);
 
-    env_free_page_tables(e->env_pml4, 3);
+    env_release_vm(e->env_pml4);
     e->env_pml4 = NULL;
 
+    /* Empty the VMA list for the next env in this slot. */
+    env_setup_vma(e);
+    vdso_global->env_frees++;
+    memset(&e->env_mem, 0, sizeof(e->env_mem));
+
     /* Return the environment to the free list */
     e->env_status = ENV_FREE;
     e->env_link = env_free_list;
@@ -507,9 +726,13 @@ void env_destroy(struct env *e)
 {
     env_free(e);
 
-    cprintf("Destroyed the only environment - nothing more to do!\n");
-    while (1)
-        monitor(NULL);
+    if (e != curenv) {
+        return;
+    }
+
+    // Run the next environment, if any
+    curenv = NULL;
+    sched_yield();
 }
 
 /*
@@ -559,16 +782,22 @@ void env_run(struct env *e)
 
     /* LAB 3: your code here. */
 
-    cprintf("[ENV RUN] start\n");
-
     // If there is any already running environment, make it runnable
-    if ((curenv != NULL) && (curenv->env_status == ENV_RUNNING))
+    // and put it at the back of its runqueue
+    if ((curenv != NULL) && (curenv != e) && (curenv->env_status == ENV_RUNNING)) {
         curenv->env_status = ENV_RUNNABLE;
+        sched_enqueue(curenv);
+    }
 
     // switch to new environment
+    sched_dequeue(e);
     curenv = e;
     curenv->env_status = ENV_RUNNING;
     curenv->env_runs += 1;
+    vdso_global->env_runs++;
+
+    // Record the startup profile once its time is up
+    profile_check(curenv, 0);
 
     load_pml4((void *)PADDR(curenv->env_pml4));
     env_pop_frame(&curenv->env_frame);
@@ -3,6 +3,12 @@
 #include <inc/env.h>
 #include <kern/cpu.h>
 
+/* Cleaned address spaces kept for reuse by env_alloc. */
+#define ENV_PML4_POOL 32
+
+/* Binaries with a template env to clone new instances from. */
+#define ENV_TEMPLATES 16
+
 extern struct env *envs;        /* All environments */
 extern struct env *curenv;      /* Current environment */
 #define curenv (thiscpu->cpu_env)   /* Current environment */
@@ -1,4 +1,5 @@
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/stdio.h>
 
 #include <inc/x86-64/asm.h>
@@ -7,10 +8,13 @@
 
 #include <kern/env.h>
 #include <kern/idt.h>
+#include <kern/console.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
 #include <kern/syscall.h>
 
 #include <kern/pmap.h>
+#include <kern/stats.h>
 #include <kern/vma.h>
 
 #include <inc/string.h>
@@ -33,6 +37,10 @@ extern void isr16(void);
 extern void isr17(void);
 extern void isr18(void);
 extern void isr19(void);
+extern void isr32(void);
+extern void isr33(void);
+extern void isr36(void);
+extern void isr39(void);
 extern void isr128(void);
 
 static const char *int_names[256] = {
@@ -154,6 +162,12 @@ void idt_init(void)
     set_idt_entry(&entries[INT_MCE], isr18, IDT_PRESENT | IDT_PRIVL(0) | IDT_INT_GATE32, GDT_KCODE);     
     set_idt_entry(&entries[INT_SIMD], isr19, IDT_PRESENT | IDT_PRIVL(0) | IDT_INT_GATE32, GDT_KCODE);
 
+    /* Hardware interrupts, the master PIC acknowledges them itself. */
+    set_idt_entry(&entries[IRQ_TIMER], isr32, IDT_PRESENT | IDT_PRIVL(0) | IDT_INT_GATE32, GDT_KCODE);
+    set_idt_entry(&entries[IRQ_KBD], isr33, IDT_PRESENT | IDT_PRIVL(0) | IDT_INT_GATE32, GDT_KCODE);
+    set_idt_entry(&entries[IRQ_SERIAL], isr36, IDT_PRESENT | IDT_PRIVL(0) | IDT_INT_GATE32, GDT_KCODE);
+    set_idt_entry(&entries[IRQ_SPURIOUS], isr39, IDT_PRESENT | IDT_PRIVL(0) | IDT_INT_GATE32, GDT_KCODE);
+
     set_idt_entry(&entries[INT_SYSCALL], isr128, IDT_PRESENT | IDT_PRIVL(3) | IDT_INT_GATE32, GDT_KCODE);
 
     idt_init_percpu();
@@ -170,9 +184,23 @@ void int_dispatch(struct int_frame *frame)
     /* Handle processor exceptions. */
     /* LAB 3: your code here. */
 
-    cprintf("Interrupt: %s, %d\n", get_int_name(frame->int_no), frame->int_no);
-
-    if (frame->int_no == INT_PAGE_FAULT) {
+    if (frame->int_no == IRQ_TIMER) {
+        sched_tick();
+        return;
+    }
+    else if (frame->int_no == IRQ_KBD) {
+        kbd_intr();
+        return;
+    }
+    else if (frame->int_no == IRQ_SERIAL) {
+        serial_intr();
+        return;
+    }
+    else if (frame->int_no == IRQ_SPURIOUS) {
+        cprintf("Spurious interrupt on irq 7\n");
+        return;
+    }
+    else if (frame->int_no == INT_PAGE_FAULT) {
         page_fault_handler(frame);
         return;
     }
@@ -204,7 +232,6 @@ void int_handler(struct int_frame *frame)
 {
     /* The environment may have set DF and some versions of GCC rely on DF being
      * clear. */
-    cprintf("Interrupt: %s, %d\n", get_int_name(frame->int_no), frame->int_no);
     asm volatile("cld" ::: "cc");
 
     /* Check that interrupts are disabled.
@@ -213,8 +240,6 @@ void int_handler(struct int_frame *frame)
      */
     assert(!(read_rflags() & FLAGS_IF));
 
-    cprintf("Incoming INT frame at %p\n", frame);
-
     if ((frame->cs & 3) == 3) {
         /* Interrupt from user mode. */
         assert(curenv);
@@ -236,12 +261,73 @@ void int_handler(struct int_frame *frame)
     env_run(curenv);
 }
 
+// Deliver a user page fault to the env's page fault upcall: push a
+// user_frame on the exception stack and resume the env in the upcall
+// Returns 1 if delivered, 0 if there is no upcall or no room for the frame
+static int page_fault_upcall(struct int_frame *frame, void *fault_va,
+                             uint64_t start)
+{
+    uintptr_t uxstack = UXSTACK_TOP - PAGE_SIZE;
+    struct user_frame *uf;
+    struct vma *vma;
+    uintptr_t top;
+
+    if (curenv->env_pgfault_upcall == NULL) {
+        return 0;
+    }
+
+    // Faulted in the upcall itself, push below its frame and red zone
+    top = UXSTACK_TOP;
+    if (frame->rsp >= uxstack && frame->rsp < UXSTACK_TOP) {
+        top = frame->rsp - USER_RED_ZONE - sizeof(uint64_t);
+    }
+    uf = (struct user_frame *) ROUNDDOWN(top - sizeof *uf, 16);
+
+    vma = vma_lookup(curenv, (void *) uxstack);
+    if (top < uxstack + sizeof *uf || vma == NULL ||
+        !(vma->perm & PAGE_WRITE) || (uintptr_t) vma->va > uxstack) {
+        cprintf("[%08x] user exception stack overflow\n", curenv->env_id);
+        return 0;
+    }
+
+    uf->fault_va = (uint64_t) fault_va;
+    uf->err_code = frame->err_code;
+    uf->r15 = frame->r15;
+    uf->r14 = frame->r14;
+    uf->r13 = frame->r13;
+    uf->r12 = frame->r12;
+    uf->r11 = frame->r11;
+    uf->r10 = frame->r10;
+    uf->r9 = frame->r9;
+    uf->r8 = frame->r8;
+    uf->rdi = frame->rdi;
+    uf->rsi = frame->rsi;
+    uf->rbp = frame->rbp;
+    uf->rbx = frame->rbx;
+    uf->rdx = frame->rdx;
+    uf->rcx = frame->rcx;
+    uf->rax = frame->rax;
+    uf->rip = frame->rip;
+    uf->rflags = frame->rflags;
+    uf->rsp = frame->rsp;
+
+    // The trap returns through curenv->env_frame, which is 'frame'
+    frame->rip = (uintptr_t) curenv->env_pgfault_upcall;
+    frame->rsp = (uintptr_t) uf;
+
+    stats_fault(FAULT_UPCALL, read_tsc() - start);
+    return 1;
+}
+
 void page_fault_handler(struct int_frame *frame)
 {
-    cprintf("[PAGE FAULT HANDLER] start\n");
+    uint64_t start = read_tsc();
     int is_user = (frame->err_code & 4) == 4;           // User or kernel space
     int is_protection = (frame->err_code & 1) == 1;     // Protection or non-present page
+    int is_write = (frame->err_code & 2) == 2;          // Write or read access
+    struct vma *vma = NULL;
     void *fault_va;
+    int kind;
 
     /* Read the CR2 register to find the faulting address. */
     fault_va = read_cr2();
@@ -249,28 +335,65 @@ void page_fault_handler(struct int_frame *frame)
     /* Handle kernel-mode page faults. */
     /* LAB 3: your code here. */
 
+    // Faults in ranges the env asked to see itself skip the kernel
+    if (is_user && curenv->env_pgfault_upcall != NULL) {
+        vma = vma_lookup(curenv, (void *) fault_va_aligned);
+        if (vma != NULL && (vma->advice & VMA_ADV_USERFAULT) &&
+            page_fault_upcall(frame, fault_va, start)) {
+            return;
+        }
+        vma = NULL;
+    }
+
     // Kernel mode error
     if (!is_user) {
-        // Kernel tries to read user space, load user space page
-        if (fault_va_aligned < KERNEL_VMA) {
-            if (page_fault_load_page((void *) fault_va_aligned)) {
-                return;
+        // Kernel tries to write a copy-on-write user page, copy it
+        if (fault_va_aligned < KERNEL_VMA && is_protection) {
+            if (is_write) {
+                vma = page_fault_cow_page((void *) fault_va_aligned);
             }
+        }
+        // Kernel tries to read user space, load user space page
+        else if (fault_va_aligned < KERNEL_VMA) {
+            vma = page_fault_load_page((void *) fault_va_aligned, is_write);
         } else {
             panic("Page fault in kernel mode - Kernel tries to read not mapped kernel space page\n");
         }
     }
     /* We have already handled kernel-mode exceptions, so if we get here, the
      * page fault has happened in user mode.
-     * Protection violations always lead to destruction of env
+     * Protection violations lead to destruction of env, unless
+     * they are writes to copy-on-write pages
      */
     else if (!is_protection) {
         // Page is not loaded, search in vma and map it in page tables
-        if (page_fault_load_page((void *) fault_va_aligned)) {
-            return;
+        vma = page_fault_load_page((void *) fault_va_aligned, is_write);
+    }
+    else if (is_write) {
+        vma = page_fault_cow_page((void *) fault_va_aligned);
+    }
+
+    // Resolved, account for it
+    if (vma != NULL) {
+        if (!is_user) {
+            kind = FAULT_KERNEL;
+        } else if (is_protection) {
+            kind = FAULT_COW;
+        } else {
+            kind = (vma->type == VMA_BINARY) ? FAULT_BINARY : FAULT_ANON;
         }
+        vma->faults++;
+        stats_fault(kind, read_tsc() - start);
+        return;
+    }
+
+    // Let the env try to handle what the kernel could not
+    if (is_user && page_fault_upcall(frame, fault_va, start)) {
+        return;
     }
 
+    stats_fault(FAULT_FATAL, read_tsc() - start);
+
     /* Destroy the environment that caused the fault. */
     cprintf("[%08x] user fault va %p ip %p\n",
         curenv->env_id, fault_va, frame->rip);
@@ -279,69 +402,64 @@ void page_fault_handler(struct int_frame *frame)
 }
 
 // Page fault has occured, load the page and map it
-int page_fault_load_page(void *fault_va_aligned) {
+// Returns the VMA of the page, or NULL if the fault can't be resolved
+struct vma *page_fault_load_page(void *fault_va_aligned, int is_write) {
     struct vma *vma;
-    struct page_info *page;
+    uintptr_t va = (uintptr_t) fault_va_aligned;
+    int r;
 
     // Get vma associated with faulting virt addr
     vma = vma_lookup(curenv, (void *)fault_va_aligned);
-    if (vma == NULL) {
-        return 0;
-    } else {
-        // There is a vma associated with this virt addr, now alloc the physical page
-        page = page_alloc(ALLOC_ZERO);
-        if (page == NULL) {
-            panic("Page fault error - couldn't allocate new page\n");
-        } else if (page_insert(curenv->env_pml4, page, (void *) fault_va_aligned, vma->perm) != 0) {
-            panic("Page fault error - couldn't map new page\n");
-        } else {
-            // Copy the binary from kernel space to user space, for anonymous memory nothing more has to be done
-            if (vma->type == VMA_BINARY) {
-                // Alligned start and end in userspace (dest)
-                uintptr_t va_aligned_start = (uintptr_t) fault_va_aligned;
-                uintptr_t va_aligned_end = (uintptr_t) fault_va_aligned + PAGE_SIZE;
-
-                // Not alligned start and end of binary in kernel space
-                uintptr_t va_file_start = (uintptr_t) vma->file_va;
-                uintptr_t va_file_end = (uintptr_t) vma->file_va + vma->file_size;
-
-                // Not alligned start and end in userspace (dest)
-                uintptr_t va_mem_start = (uintptr_t) vma->mem_va;
-                uintptr_t va_mem_end = (uintptr_t) vma->mem_va + vma->mem_size;
 
-                uintptr_t va_src_start;
-                uintptr_t va_src_end;
-                uintptr_t va_dst_start;
-                uintptr_t va_dst_end;
-
-                uint64_t offset = va_file_start - va_mem_start;
+    // Not in a VMA, but maybe right below a stack that can grow
+    if (vma == NULL) {
+        vma = vma_stack_grow(curenv, va);
+    }
+    if (vma == NULL) {
+        return NULL;
+    }
 
-                // Not alligned dest in user mem can not be before start of alligned page
-                va_dst_start = (va_mem_start < va_aligned_start) ? va_aligned_start : va_mem_start;
+    // There is a vma associated with this virt addr, now alloc the physical page
+    // An env over its hard memory limit or out of memory is destroyed, not
+    // the kernel
+    r = vma_load_page(curenv, vma, va, is_write);
+    if (r == -E_QUOTA) {
+        cprintf("[%08x] over memory limit\n", curenv->env_id);
+    } else if (r < 0) {
+        cprintf("[%08x] out of memory\n", curenv->env_id);
+    }
+    if (r < 0) {
+        return NULL;
+    }
 
-                // Not alligned dest in user mem can not be after aligned end page
-                va_dst_end = (va_mem_end > va_aligned_end) ? va_aligned_end : va_mem_end;
+    // Map the following or neighbouring pages too, to save the next faults
+    vma_readahead(curenv, vma, va, is_write);
 
-                // Source start cannot be before file start
-                va_src_start = (va_file_start < va_aligned_start + offset) ? va_aligned_start + offset : va_file_start;
+    curenv->env_mem.minor_faults++;
+    return vma;
+}
 
-                // Source end cannot be after file end
-                va_src_end = (va_file_end > va_aligned_end + offset) ? va_aligned_end + offset : va_file_end;
+// Write to a copy-on-write page, give the env its own copy
+// Returns the VMA of the page, or NULL if the fault can't be resolved
+struct vma *page_fault_cow_page(void *fault_va_aligned) {
+    struct vma *vma;
+    int r;
 
-                // Allocated zeros
-                if (va_src_end <= va_src_start)
-                    return 1;
+    vma = vma_lookup(curenv, fault_va_aligned);
+    if (vma == NULL) {
+        return NULL;
+    }
 
-                uint64_t src_size = va_src_end - va_src_start;
-                uint64_t dst_size = va_dst_end - va_dst_start;
-                uint64_t copy_size = (src_size < dst_size) ? src_size : dst_size;
+    // Out of memory for the copy, the env gets the upcall or is destroyed
+    r = vma_cow_page(curenv, vma, (uintptr_t) fault_va_aligned);
+    if (r == -E_NO_MEM) {
+        cprintf("[%08x] out of memory\n", curenv->env_id);
+    }
 
-                load_pml4((void *)PADDR(curenv->env_pml4));
-                memcpy((void *) va_dst_start, (void *) va_src_start, copy_size);
-                load_pml4((void *)PADDR(kern_pml4));
-            }
-            return 1;
-        }
+    if (r < 0) {
+        return NULL;
     }
-    return 0;
+
+    curenv->env_mem.minor_faults++;
+    return vma;
 }
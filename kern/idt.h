@@ -1,5 +1,6 @@
 #pragma once
 
+#include <inc/env.h>
 #include <inc/x86-64/idt.h>
 
 void iret64(struct int_frame *frame);
@@ -9,4 +10,5 @@ void idt_init(void);
 void idt_init_percpu(void);
 void int_handler(struct int_frame *frame);
 void page_fault_handler(struct int_frame *frame);
-int page_fault_load_page(void *fault_va_aligned);
\ No newline at end of file
+struct vma *page_fault_load_page(void *fault_va_aligned, int is_write);
+struct vma *page_fault_cow_page(void *fault_va_aligned);
@@ -0,0 +1,316 @@
+#include <inc/error.h>
+#include <inc/string.h>
+
+#include <kern/ksm.h>
+#include <kern/pmap.h>
+#include <kern/vma.h>
+
+/**
+* Kernel same-page merging: anonymous pages of VMAs advised as
+* MADV_MERGEABLE are scanned a batch at a time. Pages with identical
+* content are merged into one frame, mapped copy-on-write by all of
+* them, so a write gives the writer its own copy again.
+*
+* Merged frames are kept in the stable table, which holds a reference
+* to each of them so they are never written in place (see vma_cow_page).
+* Pages seen during the current pass are remembered in the unstable
+* table, until a second page with the same content turns up. As these
+* pages can change or go away at any time, they are looked up again
+* and compared before being merged. The unstable table is emptied after
+* every full pass.
+*/
+
+/* Buckets of each table, and nodes available for both of them. */
+#define KSM_BUCKETS 256
+#define KSM_NODES 1024
+
+struct ksm_node {
+    uint64_t hash;              // Hash of the content
+    struct page_info *page;     // The frame
+    envid_t env_id;             // Unstable only: where the page was seen
+    uintptr_t va;
+    struct ksm_node *next;
+};
+
+static struct ksm_node ksm_nodes[KSM_NODES];
+static struct ksm_node *ksm_free_nodes;
+static struct ksm_node *ksm_stable[KSM_BUCKETS];
+static struct ksm_node *ksm_unstable[KSM_BUCKETS];
+static int ksm_initialized;
+
+/* Position of the scan: the environment and address to continue at. */
+static size_t ksm_env;
+static uintptr_t ksm_va;
+
+static size_t ksm_ticks;
+static size_t ksm_merges;
+
+struct ksm_walk {
+    struct env *env;
+    struct vma *vma;
+    size_t budget;
+};
+
+static void ksm_init(void) {
+    size_t i;
+
+    for (i = 0; i < KSM_NODES; i++) {
+        ksm_nodes[i].next = ksm_free_nodes;
+        ksm_free_nodes = &ksm_nodes[i];
+    }
+    ksm_initialized = 1;
+}
+
+/* FNV-1a over the words of the page. */
+static uint64_t ksm_hash(const void *page) {
+    const uint64_t *word = page;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        hash = (hash ^ word[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+* Returns 1 if the page at 'va' of 'env' may be merged: a small page of a
+* mergeable anonymous VMA that nobody else maps.
+*/
+static int ksm_mergeable(struct env *env, uintptr_t va, struct page_info **page_store,
+    struct vma **vma_store) {
+    struct page_info *page;
+    struct vma *vma;
+    physaddr_t *entry;
+
+    vma = vma_lookup(env, (void *) va);
+    if (vma == NULL || vma->type != VMA_ANON || !(vma->advice & VMA_ADV_MERGEABLE)) {
+        return 0;
+    }
+
+    page = page_lookup(env->env_pml4, (void *) va, &entry);
+    if (page == NULL || (*entry & PAGE_HUGE) || page->pp_ref != 1) {
+        return 0;
+    }
+
+    *page_store = page;
+    *vma_store = vma;
+    return 1;
+}
+
+/* Maps the merged frame at 'va' of 'env' instead of its own page. */
+static void ksm_share(struct env *env, struct vma *vma, uintptr_t va,
+    struct page_info *frame) {
+    page_insert(env->env_pml4, frame, (void *) va, vma_shared_perm(vma->perm));
+}
+
+/**
+* Looks up where the unstable node saw its page. Returns 1 and the page and
+* VMA if it is still there and can be merged, 0 otherwise.
+*/
+static int ksm_unstable_lookup(struct ksm_node *node, struct env **env_store,
+    struct page_info **page_store, struct vma **vma_store) {
+    struct env *env = &envs[ENVX(node->env_id)];
+
+    if (env->env_status == ENV_FREE || env->env_id != node->env_id) {
+        return 0;
+    }
+    if (!ksm_mergeable(env, node->va, page_store, vma_store) ||
+        *page_store != node->page) {
+        return 0;
+    }
+
+    *env_store = env;
+    return 1;
+}
+
+/**
+* Merges the page at 'va' of the given environment and VMA with a merged
+* frame or a page seen before with the same content, or remembers it.
+*/
+static void ksm_merge_page(struct env *env, struct vma *vma, uintptr_t va,
+    struct page_info *page) {
+    struct ksm_node *node, **prev;
+    struct page_info *other;
+    struct env *other_env;
+    struct vma *other_vma;
+    uint64_t hash = ksm_hash(page2kva(page));
+    size_t bucket = hash % KSM_BUCKETS;
+
+    // Same content as a merged frame, use that one
+    for (node = ksm_stable[bucket]; node != NULL; node = node->next) {
+        if (node->hash == hash &&
+            memcmp(page2kva(node->page), page2kva(page), PAGE_SIZE) == 0) {
+            ksm_share(env, vma, va, node->page);
+            ksm_merges++;
+            return;
+        }
+    }
+
+    // Same content as a page seen in this pass, merge the two
+    prev = &ksm_unstable[bucket];
+    while ((node = *prev) != NULL) {
+        if (node->hash != hash) {
+            prev = &node->next;
+            continue;
+        }
+
+        // Gone or changed hands since, forget about it
+        if (!ksm_unstable_lookup(node, &other_env, &other, &other_vma)) {
+            *prev = node->next;
+            node->next = ksm_free_nodes;
+            ksm_free_nodes = node;
+            continue;
+        }
+
+        if (other == page || memcmp(page2kva(other), page2kva(page), PAGE_SIZE) != 0) {
+            prev = &node->next;
+            continue;
+        }
+
+        // Its frame becomes the merged frame, referenced by the stable table
+        *prev = node->next;
+        node->next = ksm_stable[bucket];
+        ksm_stable[bucket] = node;
+        other->pp_ref++;
+
+        ksm_share(other_env, other_vma, node->va, other);
+        ksm_share(env, vma, va, other);
+        ksm_merges++;
+        return;
+    }
+
+    // Remember it for the rest of the pass
+    if ((node = ksm_free_nodes) == NULL) {
+        return;
+    }
+    ksm_free_nodes = node->next;
+
+    node->hash = hash;
+    node->page = page;
+    node->env_id = env->env_id;
+    node->va = va;
+    node->next = ksm_unstable[bucket];
+    ksm_unstable[bucket] = node;
+}
+
+/**
+* Ends a pass: forgets the unstable table and frees the merged frames that
+* are no longer mapped by anyone.
+*/
+static void ksm_pass_done(void) {
+    struct ksm_node *node, **prev;
+    size_t i;
+
+    for (i = 0; i < KSM_BUCKETS; i++) {
+        while ((node = ksm_unstable[i]) != NULL) {
+            ksm_unstable[i] = node->next;
+            node->next = ksm_free_nodes;
+            ksm_free_nodes = node;
+        }
+
+        prev = &ksm_stable[i];
+        while ((node = *prev) != NULL) {
+            if (node->page->pp_ref > 1) {
+                prev = &node->next;
+                continue;
+            }
+            *prev = node->next;
+            page_decref(node->page);
+            node->next = ksm_free_nodes;
+            ksm_free_nodes = node;
+        }
+    }
+}
+
+/* page_walk_range callback of ksm_scan, looks at one page. */
+static int ksm_scan_entry(physaddr_t *entry, uintptr_t va, void *arg) {
+    struct ksm_walk *walk = arg;
+    struct page_info *page = pa2page(PAGE_ADDR(*entry));
+
+    // Out of budget, continue here next time
+    if (walk->budget == 0) {
+        ksm_va = va;
+        return 1;
+    }
+    walk->budget--;
+
+    if (!(*entry & PAGE_HUGE) && page->pp_ref == 1) {
+        ksm_merge_page(walk->env, walk->vma, va, page);
+    }
+    return 0;
+}
+
+/**
+* Scans up to 'npages' mapped pages of mergeable VMAs, continuing where the
+* previous scan stopped, and merges the identical ones. Stops early after
+* completing a pass over all environments.
+*/
+void ksm_scan(size_t npages) {
+    struct ksm_walk walk;
+    struct env *env;
+    struct vma *vma;
+    uintptr_t start, end;
+
+    if (!ksm_initialized) {
+        ksm_init();
+    }
+
+    walk.budget = npages;
+    while (walk.budget > 0) {
+        env = &envs[ksm_env];
+
+        if (env->env_status != ENV_FREE) {
+            for (vma = env->vma; vma != NULL && vma->type != VMA_UNUSED; vma = vma->next) {
+                start = MAX(ksm_va, (uintptr_t) vma->va);
+                end = (uintptr_t) vma->va + vma->len;
+                if (vma->type != VMA_ANON || !(vma->advice & VMA_ADV_MERGEABLE) ||
+                    start >= end) {
+                    continue;
+                }
+
+                walk.env = env;
+                walk.vma = vma;
+                if (page_walk_range(env->env_pml4, start, end, ksm_scan_entry, &walk) != 0) {
+                    return;
+                }
+                ksm_va = end;
+            }
+        }
+
+        // Next environment, or a new pass after the last one
+        ksm_va = 0;
+        if (++ksm_env == NENV) {
+            ksm_env = 0;
+            ksm_pass_done();
+            return;
+        }
+    }
+}
+
+/* Scans a batch of pages every KSM_TICK_INTERVAL timer ticks. */
+void ksm_tick(void) {
+    if (++ksm_ticks % KSM_TICK_INTERVAL == 0) {
+        ksm_scan(KSM_BATCH_PAGES);
+    }
+}
+
+/**
+* Returns the number of merged frames in 'shared', the number of mappings
+* of them in 'sharing' and the number of merges done so far in 'merges'.
+* The memory saved is sharing - shared pages.
+*/
+void ksm_stats(size_t *shared, size_t *sharing, size_t *merges) {
+    struct ksm_node *node;
+    size_t i;
+
+    *shared = 0;
+    *sharing = 0;
+    for (i = 0; i < KSM_BUCKETS; i++) {
+        for (node = ksm_stable[i]; node != NULL; node = node->next) {
+            (*shared)++;
+            *sharing += node->page->pp_ref - 1;
+        }
+    }
+    *merges = ksm_merges;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <kern/env.h>
+
+/* Every KSM_TICK_INTERVAL timer ticks, KSM_BATCH_PAGES are scanned. */
+#define KSM_TICK_INTERVAL 8
+#define KSM_BATCH_PAGES 64
+
+void ksm_scan(size_t npages);
+void ksm_tick(void);
+void ksm_stats(size_t *shared, size_t *sharing, size_t *merges);
@@ -3,8 +3,13 @@
 #include <kern/idt.h>
 #include <kern/gdt.h>
 #include <kern/monitor.h>
+#include <kern/picirq.h>
 #include <kern/pmap.h>
+#include <kern/sched.h>
 #include <kern/syscall.h>
+#include <kern/timer.h>
+#include <kern/tsc.h>
+#include <kern/vdso.h>
 
 #include <inc/boot.h>
 #include <inc/stdio.h>
@@ -27,12 +32,20 @@ void kmain(struct boot_info *boot_info)
     /* Lab 1 memory management initialization functions */
     mem_init(boot_info);
 
+    /* Time base for the startup profiles and the vDSO */
+    tsc_calibrate();
+    vdso_init();
+
     /* Lab 3 user environment initialization functions */
     gdt_init();
     idt_init();
     syscall_init();
     env_init();
 
+    /* Timer interrupts drive the scheduler */
+    pic_init();
+    timer_init();
+
 #if defined(TEST)
     /* Don't touch -- used by grading script! */
     ENV_CREATE(TEST, ENV_TYPE_USER);
@@ -41,8 +54,8 @@ void kmain(struct boot_info *boot_info)
     ENV_CREATE(user_divzero, ENV_TYPE_USER);
 #endif
 
-    /* We only have one user environment for now, so just run it. */
-    env_run(&envs[0]);
+    /* Schedule the environments created above. */
+    sched_yield();
 }
 
 /*
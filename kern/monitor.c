@@ -10,7 +10,10 @@
 #include <inc/x86-64/asm.h>
 
 #include <kern/console.h>
+#include <kern/env.h>
+#include <kern/ksm.h>
 #include <kern/monitor.h>
+#include <kern/stats.h>
 
 #define CMDBUF_SIZE 80  /* enough for one VGA text line */
 
@@ -25,6 +28,10 @@ static struct command commands[] = {
     { "help", "Display this list of commands", mon_help },
     { "kerninfo", "Display information about the kernel", mon_kerninfo },
     { "backtrace", "Display stack backtrace", mon_backtrace },
+    { "ksm", "Merge identical pages and display the memory saved", mon_ksm },
+    { "mem", "Display the memory used by each environment", mon_mem },
+    { "faults", "Display page fault latencies, or the faults per VMA of an env",
+      mon_faults },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -81,6 +88,96 @@ int mon_backtrace(int argc, char **argv, struct int_frame *frame)
     return 0;
 }
 
+int mon_ksm(int argc, char **argv, struct int_frame *frame)
+{
+    size_t shared, sharing, merges;
+
+    /* Finish the current pass over all environments. */
+    ksm_scan((size_t) -1);
+    ksm_stats(&shared, &sharing, &merges);
+
+    cprintf("Merged frames: %u, mapped %u times, %u merges so far\n",
+        shared, sharing, merges);
+    cprintf("Memory saved: %uKB\n", (sharing - shared) * PAGE_SIZE / 1024);
+    return 0;
+}
+
+int mon_mem(int argc, char **argv, struct int_frame *frame)
+{
+    struct env_mem *mem;
+    size_t i;
+
+    cprintf("env       rss(KB)     4K     2M tables vmas   faults populates\n");
+    for (i = 0; i < NENV; i++) {
+        if (envs[i].env_status == ENV_FREE) {
+            continue;
+        }
+        mem = &envs[i].env_mem;
+        cprintf("%08x %8lu %6lu %6lu %6lu %4u %8lu %9lu\n", envs[i].env_id,
+            (mem->rss_pages * PAGE_SIZE + mem->rss_huge * PAGE_TABLE_SPAN) / 1024,
+            mem->rss_pages, mem->rss_huge, mem->pt_pages, mem->vmas,
+            mem->minor_faults, mem->populates);
+    }
+    return 0;
+}
+
+static const char *fault_kinds[FAULT_NKINDS] = {
+    [FAULT_ANON]    = "anon",
+    [FAULT_BINARY]  = "binary",
+    [FAULT_COW]     = "cow",
+    [FAULT_KERNEL]  = "kernel",
+    [FAULT_UPCALL]  = "upcall",
+    [FAULT_FATAL]   = "fatal",
+};
+
+int mon_faults(int argc, char **argv, struct int_frame *frame)
+{
+    uint64_t count, cycles, hist;
+    struct env *e;
+    struct vma *vma;
+    size_t cpu, kind, i;
+
+    // faults <envid>: the faults of each VMA of that environment
+    if (argc > 1) {
+        if (envid2env(strtol(argv[1], NULL, 16), &e, 0) < 0) {
+            cprintf("No environment %s\n", argv[1]);
+            return 0;
+        }
+        cprintf("%08x: %lu faults\n", e->env_id, e->env_mem.minor_faults);
+        for (vma = e->vma; vma != NULL && vma->type != VMA_UNUSED; vma = vma->next) {
+            cprintf("  %016lx-%016lx type %d: %lu faults\n", (uintptr_t) vma->va,
+                (uintptr_t) vma->va + vma->len, vma->type, vma->faults);
+        }
+        return 0;
+    }
+
+    // Histograms of all CPUs together, bucket i is [2^i, 2^(i+1)) cycles
+    for (kind = 0; kind < FAULT_NKINDS; kind++) {
+        count = cycles = 0;
+        for (cpu = 0; cpu < STATS_NCPU; cpu++) {
+            count += kern_stats->faults[cpu].count[kind];
+            cycles += kern_stats->faults[cpu].cycles[kind];
+        }
+        cprintf("%-6s %lu faults", fault_kinds[kind], count);
+        if (count == 0) {
+            cprintf("\n");
+            continue;
+        }
+        cprintf(", mean %lu cycles\n", cycles / count);
+
+        for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+            hist = 0;
+            for (cpu = 0; cpu < STATS_NCPU; cpu++) {
+                hist += kern_stats->faults[cpu].hist[kind][i];
+            }
+            if (hist != 0) {
+                cprintf("  2^%u cycles: %lu\n", i, hist);
+            }
+        }
+    }
+    return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -17,5 +17,8 @@ void monitor(struct int_frame *frame);
 int mon_help(int argc, char **argv, struct int_frame *frame);
 int mon_kerninfo(int argc, char **argv, struct int_frame *frame);
 int mon_backtrace(int argc, char **argv, struct int_frame *frame);
+int mon_ksm(int argc, char **argv, struct int_frame *frame);
+int mon_mem(int argc, char **argv, struct int_frame *frame);
+int mon_faults(int argc, char **argv, struct int_frame *frame);
 
 #endif /* !JOS_KERN_MONITOR_H */
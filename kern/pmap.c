@@ -41,13 +41,20 @@
 
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/stats.h>
+#include <kern/vdso.h>
 #include <kern/lab1.c>
 
+/* Ranges of more pages than this are flushed from the TLB by reloading CR3. */
+#define TLB_FLUSH_PAGES 32
+
 /* These variables are set in mem_init() */
 size_t npages;
 struct page_table *kern_pml4;           /* Kernel's initial PML4 */
 struct page_info *pages;                /* Physical page state array */
 struct page_info *page_free_list;       /* Free list of physical pages */
+struct page_info *zero_page;            /* Shared page of zeros */
+struct page_info *zero_huge_page;       /* Shared huge page of zeros, or NULL */
 
 /***************************************************************
  * Set up memory mappings above UTOP.
@@ -57,6 +64,8 @@ static void boot_map_region(struct page_table *pml4, uintptr_t va, size_t size,
     physaddr_t pa, uint64_t perm);
 static void boot_map_kernel(struct elf *elf_hdr);
 static physaddr_t *page_walk(struct page_table *pml4, const void *va, int create);
+static physaddr_t *page_walk_mem(struct page_table *pml4, const void *va,
+    int create, struct env_mem *mem);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pml4(void);
@@ -188,8 +197,21 @@ void mem_init(struct boot_info *boot_info)
     for (i = 0; i < NENV; i++) {
         vma_list = boot_alloc(sizeof(struct vma)*128);
         envs[i].vma = vma_list;
+        envs[i].env_vmas = vma_list;
     }
 
+    /*********************************************************************
+     * Allocate the kernel statistics, starting at zero.
+     */
+    kern_stats = boot_alloc(ROUNDUP(sizeof(struct kern_stats), PAGE_SIZE));
+    memset(kern_stats, 0, sizeof(struct kern_stats));
+
+    /*********************************************************************
+     * Allocate the global kernel data of the vDSO, starting at zero.
+     */
+    vdso_global = boot_alloc(PAGE_SIZE);
+    memset(vdso_global, 0, PAGE_SIZE);
+
     /*********************************************************************
      * Now that we've allocated the initial kernel data structures, we set
      * up the list of free physical pages. Once we've done so, all further
@@ -233,6 +255,27 @@ void mem_init(struct boot_info *boot_info)
     physaddr_t *addr;
     addr = page_walk(kern_pml4, (void *)USER_ENVS, 0);
 
+    /*********************************************************************
+     * Map the kernel statistics read-only by the user at USER_STATS,
+     * right after the 'pages' image.
+     * Permissions: kernel RW, user R
+     */
+    assert(ROUNDUP(npages * sizeof(struct page_info), PAGE_SIZE) <=
+           USER_STATS - USER_PAGES);
+    static_assert(sizeof(struct kern_stats) <= USER_KDATA - USER_STATS);
+    boot_map_region(kern_pml4, USER_STATS,
+        ROUNDUP(sizeof(struct kern_stats), PAGE_SIZE),
+        PADDR(kern_stats), PAGE_NO_EXEC | PAGE_USER);
+
+    /*********************************************************************
+     * Map the global kernel data of the vDSO read-only by the user at
+     * USER_KDATA, in the last page of the statistics block.
+     * Permissions: kernel RW, user R
+     */
+    static_assert(sizeof(struct vdso_global) <= PAGE_SIZE);
+    boot_map_region(kern_pml4, USER_KDATA, PAGE_SIZE,
+        PADDR(vdso_global), PAGE_NO_EXEC | PAGE_USER);
+
     /*********************************************************************
      * Map the 'VMAs' array as kernel RW, user NONE
      */
@@ -297,6 +340,10 @@ void mem_init(struct boot_info *boot_info)
      * kern_pml4 wrong. */
     load_pml4((void *)PADDR(kern_pml4));
 
+    /* Make the kernel respect read-only user mappings too, so that its
+     * writes to copy-on-write pages fault as well. */
+    write_cr0(read_cr0() | CR0_WP);
+
     check_page_free_list(0);
 
     /* Some more checks, only possible after kern_pml4 is installed. */
@@ -307,6 +354,18 @@ void mem_init(struct boot_info *boot_info)
 
     check_page_hugepages();
 
+    /* Pages of zeros mapped copy-on-write for reads of untouched anonymous
+     * memory, pinned so they are never freed. Without a huge one, small
+     * pages are used. */
+    zero_page = page_alloc(ALLOC_ZERO);
+    if (zero_page == NULL)
+        panic("Couldn't allocate the zero page");
+    zero_page->pp_ref++;
+
+    zero_huge_page = page_alloc(ALLOC_HUGE | ALLOC_ZERO);
+    if (zero_huge_page != NULL)
+        zero_huge_page->pp_ref++;
+
     boot_map_region(kern_pml4, KERNEL_VMA, 0x100000000, 0, PAGE_WRITE);
     cprintf("[MEM_INIT] END\n");
 }
@@ -375,6 +434,11 @@ void page_init(struct boot_info *boot_info)
                 }
                 page_free_list = page;
             } 
+            // Read-only parts of the user binaries in the kernel image are
+            // mapped into user space directly, never let them be freed
+            else if (pa >= KERNEL_LMA && pa < end) {
+                page->pp_ref = 1;
+            }
         }
     }
 
@@ -577,11 +641,42 @@ static void boot_map_kernel(struct elf *elf_hdr)
     }
 }
 
+/*
+ * Returns the memory accounting of the environment whose page tables are
+ * rooted at 'pml4', or NULL for the kernel's page tables. Nearly all
+ * updates are to the current environment, so it is checked first, then
+ * the environment found last time, before scanning all of them.
+ */
+struct env_mem *pml4_mem(struct page_table *pml4)
+{
+    static struct env *last;
+    size_t i;
+
+    if (pml4 == kern_pml4 || envs == NULL) {
+        return NULL;
+    }
+    if (curenv != NULL && curenv->env_pml4 == pml4) {
+        return &curenv->env_mem;
+    }
+    if (last != NULL && last->env_status != ENV_FREE && last->env_pml4 == pml4) {
+        return &last->env_mem;
+    }
+
+    for (i = 0; i < NENV; i++) {
+        if (envs[i].env_status != ENV_FREE && envs[i].env_pml4 == pml4) {
+            last = &envs[i];
+            return &last->env_mem;
+        }
+    }
+    return NULL;
+}
+
 /* Check if 'entry' is an entry pointing to a table or still empty
  * If entry is already valid, return entry.
- * If not, create a new table and let entry point to it
+ * If not, create a new table and let entry point to it,
+ * counting it in 'mem' if not NULL
  */
-int entry_in_table(physaddr_t *entry, int create) 
+int entry_in_table(physaddr_t *entry, int create, struct env_mem *mem) 
 {   
     struct page_table *new;
     struct page_info *page;
@@ -603,6 +698,9 @@ int entry_in_table(physaddr_t *entry, int create)
             page->pp_ref++;
             new = (struct page_table *)KADDR(page2pa(page));
             *entry = PADDR(new) | PAGE_PRESENT | PAGE_USER | PAGE_WRITE;
+            if (mem != NULL) {
+                mem->pt_pages++;
+            }
         }
     }
     return 1;
@@ -633,20 +731,30 @@ int entry_in_table(physaddr_t *entry, int create)
  */
 physaddr_t *page_walk(struct page_table *pml4, const void *va, int create)
 {
-    struct page_info *page;
+    return page_walk_mem(pml4, va, create, create ? pml4_mem(pml4) : NULL);
+}
+
+/*
+ * page_walk, counting the page table pages it creates in 'mem' (the
+ * accounting of the owner of 'pml4', may be NULL), for callers that
+ * already looked it up.
+ */
+static physaddr_t *page_walk_mem(struct page_table *pml4, const void *va,
+    int create, struct env_mem *mem)
+{
     struct page_table *pdp, *pd, *pt;
     physaddr_t *entry;
 
     // Pml4 entry. Check if exists, if not create new entry + table if possible
     entry = pml4->entries + PML4_INDEX((uintptr_t) va);
-    if (!entry_in_table(entry, create)) {
+    if (!entry_in_table(entry, create, mem)) {
         return NULL;
     }
 
     // PDP entry
     pdp = (struct page_table *)KADDR(PAGE_ADDR(*entry));
     entry = pdp->entries + PDPT_INDEX((uintptr_t) va);
-    if (!entry_in_table(entry, create)) {
+    if (!entry_in_table(entry, create, mem)) {
         return NULL;
     }
 
@@ -657,7 +765,7 @@ physaddr_t *page_walk(struct page_table *pml4, const void *va, int create)
     // Only for small pages, search for page table
     // If create == 0, we can still be searching for huge pages!
     if (create != CREATE_HUGE && !(!create && (*entry & PAGE_HUGE))) {
-        if (!entry_in_table(entry, create)) {
+        if (!entry_in_table(entry, create, mem)) {
             return NULL;
         }
 
@@ -681,6 +789,142 @@ physaddr_t *page_walk(struct page_table *pml4, const void *va, int create)
     return entry;
 }
 
+/*
+ * Returns a pointer to the page directory entry covering 'va' in the page
+ * tables rooted at 'pml4', or NULL if the page directory does not exist.
+ * The entry itself may be empty, point to a page table or map a huge page.
+ */
+physaddr_t *page_walk_pde(struct page_table *pml4, const void *va)
+{
+    struct page_table *pdp, *pd;
+    physaddr_t *entry;
+
+    entry = pml4->entries + PML4_INDEX((uintptr_t) va);
+    if (!(*entry & PAGE_PRESENT)) {
+        return NULL;
+    }
+
+    pdp = (struct page_table *)KADDR(PAGE_ADDR(*entry));
+    entry = pdp->entries + PDPT_INDEX((uintptr_t) va);
+    if (!(*entry & PAGE_PRESENT)) {
+        return NULL;
+    }
+
+    pd = (struct page_table *)KADDR(PAGE_ADDR(*entry));
+    return pd->entries + PAGE_DIR_INDEX((uintptr_t) va);
+}
+
+/*
+ * Returns how many page table pages mapping the range <start, end) would
+ * create in the page tables rooted at 'pml4': missing page directory
+ * pointer tables and page directories, and, unless the range is mapped
+ * with huge pages ('huge'), missing page tables.
+ */
+size_t page_tables_missing(struct page_table *pml4, uintptr_t start,
+    uintptr_t end, int huge)
+{
+    physaddr_t *pde;
+    uintptr_t va;
+    size_t missing = 0;
+
+    if (start >= end) {
+        return 0;
+    }
+
+    for (va = ROUNDDOWN(start, PDPT_SPAN); va < end; va += PDPT_SPAN) {
+        if (!(pml4->entries[PML4_INDEX(va)] & PAGE_PRESENT)) {
+            missing++;
+        }
+    }
+
+    for (va = ROUNDDOWN(start, PAGE_DIR_SPAN); va < end; va += PAGE_DIR_SPAN) {
+        if (page_walk_pde(pml4, (void *) va) == NULL) {
+            missing++;
+        }
+    }
+
+    if (huge) {
+        return missing;
+    }
+
+    for (va = ROUNDDOWN(start, PAGE_TABLE_SPAN); va < end; va += PAGE_TABLE_SPAN) {
+        pde = page_walk_pde(pml4, (void *) va);
+        if (pde == NULL || !(*pde & PAGE_PRESENT)) {
+            missing++;
+        }
+    }
+    return missing;
+}
+
+/*
+ * Splits the huge page mapped at 'va' into small pages. A new page table is
+ * filled with entries mapping the same physical memory with the same
+ * permissions, and the huge page becomes 512 separately counted small pages.
+ * Does nothing if 'va' is not mapped by a huge page.
+ *
+ * The huge page may only be mapped here (pp_ref == 1), otherwise the other
+ * mappings would no longer match the reference counts.
+ *
+ * The shared zero huge page becomes 512 mappings of the small zero page.
+ *
+ * Returns 0 on success, -E_NO_MEM if no page table could be allocated,
+ * -E_INVAL if the huge page is mapped more than once.
+ */
+int page_demote(struct page_table *pml4, void *va)
+{
+    struct env_mem *mem;
+    struct page_info *huge, *table;
+    struct page_table *pt;
+    physaddr_t *pde;
+    physaddr_t flags;
+    size_t i;
+
+    pde = page_walk_pde(pml4, va);
+    if (pde == NULL || !(*pde & PAGE_PRESENT) || !(*pde & PAGE_HUGE)) {
+        return 0;
+    }
+
+    huge = pa2page(PAGE_ADDR(*pde));
+    if (huge->pp_ref != 1 && huge != zero_huge_page) {
+        return -E_INVAL;
+    }
+
+    table = page_alloc(ALLOC_ZERO);
+    if (table == NULL) {
+        return -E_NO_MEM;
+    }
+    table->pp_ref++;
+    pt = (struct page_table *)page2kva(table);
+
+    // Same permissions, bit 7 means PAT in a page table entry
+    flags = *pde & PAGE_MASK & ~((physaddr_t) PAGE_HUGE);
+    if (huge == zero_huge_page) {
+        for (i = 0; i < SMALL_PAGES_IN_HUGE; i++) {
+            pt->entries[i] = page2pa(zero_page) | flags;
+        }
+        zero_page->pp_ref += SMALL_PAGES_IN_HUGE;
+        page_decref(zero_huge_page);
+    } else {
+        for (i = 0; i < SMALL_PAGES_IN_HUGE; i++) {
+            pt->entries[i] = (PAGE_ADDR(*pde) + i * PAGE_SIZE) | flags;
+            huge[i].is_huge = 0;
+            huge[i].pp_ref = 1;
+        }
+    }
+
+    // New entry: kernel R, user R, like entry_in_table
+    *pde = PADDR(pt) | PAGE_PRESENT | PAGE_USER | PAGE_WRITE;
+    tlb_invalidate(pml4, (void *) ROUNDDOWN((uintptr_t) va, PAGE_TABLE_SPAN));
+
+    if ((mem = pml4_mem(pml4)) != NULL) {
+        mem->rss_huge--;
+        mem->rss_pages += SMALL_PAGES_IN_HUGE;
+        mem->pt_pages++;
+    }
+
+    return 0;
+}
+
 /*
  * Map the physical page 'pp' at virtual address 'va'.
  * The permissions (the low 12 bits) of the page table entry
@@ -708,14 +952,15 @@ physaddr_t *page_walk(struct page_table *pml4, const void *va, int create)
  */
 int page_insert(struct page_table *pml4, struct page_info *pp, void *va, int perm)
 {
+    struct env_mem *mem = pml4_mem(pml4);
     physaddr_t *addr;
     struct page_info *page;
 
     // Get page table entry
     if (pp->is_huge == 0) {
-        addr = page_walk(pml4, va, CREATE_NORMAL);
+        addr = page_walk_mem(pml4, va, CREATE_NORMAL, mem);
     } else {
-        addr = page_walk(pml4, va, CREATE_HUGE);
+        addr = page_walk_mem(pml4, va, CREATE_HUGE, mem);
     }
 
     // Could not get page table entry for some reason, error
@@ -755,6 +1000,14 @@ int page_insert(struct page_table *pml4, struct page_info *pp, void *va, int per
     // Link page table entry to new page, PAGE_HUGE is handled via perm argument
     pp->pp_ref++;
     *addr = page2pa(pp) | perm | PAGE_PRESENT;
+
+    if (mem != NULL) {
+        if (perm & PAGE_HUGE) {
+            mem->rss_huge++;
+        } else {
+            mem->rss_pages++;
+        }
+    }
     return 0;
 }
 
@@ -807,6 +1060,7 @@ struct page_info *page_lookup(struct page_table *pml4, void *va,
  */
 void page_remove(struct page_table *pml4, void *va)
 {
+    struct env_mem *mem;
     struct page_info *page;
     physaddr_t *pt_entry = NULL;
 
@@ -820,6 +1074,14 @@ void page_remove(struct page_table *pml4, void *va)
     // Decrement link count of physical page, gets freed if it reaches 0
     page_decref(page);  
 
+    if ((mem = pml4_mem(pml4)) != NULL) {
+        if (*pt_entry & PAGE_HUGE) {
+            mem->rss_huge--;
+        } else {
+            mem->rss_pages--;
+        }
+    }
+
     // Set entry in pg table to 0
     *pt_entry = 0;
 
@@ -838,6 +1100,173 @@ void tlb_invalidate(struct page_table *pml4, void *va)
     flush_page(va);
 }
 
+/*
+ * Invalidate the TLB entries for the range [start, end) in one go.
+ * Small ranges are flushed page by page, for larger ranges reloading
+ * CR3 (which drops all non-global entries) is cheaper.
+ * Only the current address space is cached in the TLB; other page
+ * tables are flushed anyway when they are loaded.
+ */
+void tlb_invalidate_range(struct page_table *pml4, uintptr_t start, uintptr_t end)
+{
+    uintptr_t vi;
+
+    if (read_cr3() != PADDR(pml4)) {
+        return;
+    }
+
+    if (PAGE_INDEX(end - start) > TLB_FLUSH_PAGES) {
+        load_pml4((struct page_table *)read_cr3());
+        return;
+    }
+
+    for (vi = start; vi < end; vi += PAGE_SIZE) {
+        flush_page((void *)vi);
+    }
+}
+
+/*
+ * Walks the page tables rooted at 'pml4' over the range [start, end) and
+ * calls 'func' for every present leaf entry: the PTE of a small page, or the
+ * PDE of a huge page (in which case 'va' is the start of the huge page).
+ * Missing page tables are skipped as a whole instead of page by page.
+ *
+ * Nothing is flushed from the TLB, the caller should do that once for the
+ * whole range with tlb_invalidate_range.
+ *
+ * Returns 0, or the first non-zero value returned by 'func', which also
+ * stops the walk.
+ */
+int page_walk_range(struct page_table *pml4, uintptr_t start, uintptr_t end,
+    page_walk_func_t func, void *arg)
+{
+    struct page_table *pdp, *pd, *pt;
+    physaddr_t *entry;
+    uintptr_t va = start;
+    int r;
+
+    while (va < end) {
+        // Pml4 entry, skip a whole PDP table if missing
+        entry = pml4->entries + PML4_INDEX(va);
+        if (!(*entry & PAGE_PRESENT)) {
+            va = ROUNDDOWN(va, PDPT_SPAN) + PDPT_SPAN;
+            continue;
+        }
+
+        // PDP entry, skip a whole page directory if missing
+        pdp = (struct page_table *)KADDR(PAGE_ADDR(*entry));
+        entry = pdp->entries + PDPT_INDEX(va);
+        if (!(*entry & PAGE_PRESENT)) {
+            va = ROUNDDOWN(va, PAGE_DIR_SPAN) + PAGE_DIR_SPAN;
+            continue;
+        }
+
+        // Page dir entry, skip a whole page table if missing
+        pd = (struct page_table *)KADDR(PAGE_ADDR(*entry));
+        entry = pd->entries + PAGE_DIR_INDEX(va);
+        if (!(*entry & PAGE_PRESENT)) {
+            va = ROUNDDOWN(va, PAGE_TABLE_SPAN) + PAGE_TABLE_SPAN;
+            continue;
+        }
+
+        // Huge page, the page dir entry is the leaf
+        if (*entry & PAGE_HUGE) {
+            if ((r = func(entry, ROUNDDOWN(va, PAGE_TABLE_SPAN), arg)) != 0) {
+                return r;
+            }
+            va = ROUNDDOWN(va, PAGE_TABLE_SPAN) + PAGE_TABLE_SPAN;
+            continue;
+        }
+
+        // Small pages, visit the page table up to its end or the range end
+        pt = (struct page_table *)KADDR(PAGE_ADDR(*entry));
+        do {
+            entry = pt->entries + PAGE_TABLE_INDEX(va);
+            if (*entry & PAGE_PRESENT) {
+                if ((r = func(entry, va, arg)) != 0) {
+                    return r;
+                }
+            }
+            va += PAGE_SIZE;
+        } while (va < end && PAGE_TABLE_INDEX(va) != 0);
+    }
+
+    return 0;
+}
+
+struct page_move_args {
+    struct page_table *pml4;
+    struct env_mem *mem;
+    uintptr_t from, to;
+    int move;
+};
+
+/*
+ * page_walk_range callback of page_move_range. Makes sure the page table
+ * for the destination of the entry exists and, in the second pass, moves
+ * the entry there.
+ */
+static int page_move_entry(physaddr_t *entry, uintptr_t va, void *arg)
+{
+    struct page_move_args *args = arg;
+    uintptr_t dst_va = va - args->from + args->to;
+    int huge = (*entry & PAGE_HUGE) != 0;
+    physaddr_t *dst;
+
+    if (huge && dst_va % PAGE_TABLE_SPAN != 0) {
+        return -E_INVAL;
+    }
+
+    dst = page_walk_mem(args->pml4, (void *) dst_va,
+                        huge ? CREATE_HUGE : CREATE_NORMAL, args->mem);
+    if (dst == NULL) {
+        return -E_NO_MEM;
+    }
+
+    // An empty page table left at the destination makes room for the huge page
+    if (huge && (*dst & PAGE_PRESENT)) {
+        page_decref(pa2page(PAGE_ADDR(*dst)));
+        *dst = 0;
+        if (args->mem != NULL) {
+            args->mem->pt_pages--;
+        }
+    }
+
+    if (args->move) {
+        *dst = *entry;
+        *entry = 0;
+    }
+    return 0;
+}
+
+/*
+ * Moves the mappings of the range [from, from + size) in the page tables
+ * rooted at 'pml4' so that they start at 'to', without touching the mapped
+ * pages or their reference counts. The destination range must be unmapped,
+ * and huge pages can only be moved by a multiple of their size.
+ *
+ * All page tables needed at the destination are allocated before the
+ * first entry is moved, so the mappings are unchanged on failure.
+ *
+ * Returns 0 on success, -E_NO_MEM if a page table could not be allocated,
+ * -E_INVAL if a huge page would end up misaligned.
+ */
+int page_move_range(struct page_table *pml4, uintptr_t from, uintptr_t to,
+    size_t size)
+{
+    struct page_move_args args = { pml4, pml4_mem(pml4), from, to, 0 };
+    int r;
+
+    if ((r = page_walk_range(pml4, from, from + size, page_move_entry, &args)) < 0) {
+        return r;
+    }
+
+    args.move = 1;
+    page_walk_range(pml4, from, from + size, page_move_entry, &args);
+    tlb_invalidate_range(pml4, from, from + size);
+    return 0;
+}
+
 static uintptr_t user_mem_check_addr;
 
 /*
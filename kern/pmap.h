@@ -18,10 +18,14 @@ struct env;
 
 struct env;
 
+struct env_mem;
+
 extern char bootstacktop[], bootstack[];
 
 extern struct page_info *pages;
 extern struct page_info *page_free_list;
+extern struct page_info *zero_page;
+extern struct page_info *zero_huge_page;
 extern size_t npages;
 extern struct page_table *kern_pml4;
 
@@ -58,6 +62,10 @@ enum {
     ALLOC_PREMAPPED = 1<<2,
 };
 
+/* Software bit: the page is shared copy-on-write and mapped read-only,
+ * a write fault gives the environment its own copy. */
+#define PAGE_COW (1 << 9)
+
 enum {
     /* For page_walk, tells whether to create normal page or huge page */
     CREATE_NORMAL = 1<<0,
@@ -74,8 +82,21 @@ int page_insert(struct page_table *pml4, struct page_info *pp, void *va, int per
 void page_remove(struct page_table *pml4, void *va);
 struct page_info *page_lookup(struct page_table *pml4, void *va, physaddr_t **entry);
 void page_decref(struct page_info *pp);
+physaddr_t *page_walk_pde(struct page_table *pml4, const void *va);
+size_t page_tables_missing(struct page_table *pml4, uintptr_t start,
+    uintptr_t end, int huge);
+int page_demote(struct page_table *pml4, void *va);
+struct env_mem *pml4_mem(struct page_table *pml4);
 
 void tlb_invalidate(struct page_table *pml4, void *va);
+void tlb_invalidate_range(struct page_table *pml4, uintptr_t start, uintptr_t end);
+
+/* Callback of page_walk_range, called for each present leaf entry. */
+typedef int (*page_walk_func_t)(physaddr_t *entry, uintptr_t va, void *arg);
+int page_walk_range(struct page_table *pml4, uintptr_t start, uintptr_t end,
+    page_walk_func_t func, void *arg);
+int page_move_range(struct page_table *pml4, uintptr_t from, uintptr_t to,
+    size_t size);
 
 static inline physaddr_t page2pa(struct page_info *pp)
 {
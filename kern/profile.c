@@ -0,0 +1,121 @@
+#include <inc/x86-64/asm.h>
+
+#include <kern/pmap.h>
+#include <kern/profile.h>
+#include <kern/tsc.h>
+#include <kern/vma.h>
+
+/**
+* Startup profiles: for each embedded binary, keyed by its _binary_obj_*
+* start symbol, the pages of its binary VMAs that the last environment
+* running it accessed during its first PROFILE_WINDOW_MS. The accessed
+* bits are collected once the window is over (or when the environment
+* exits before that). The next environment running the binary gets
+* those pages mapped by load_icode, instead of faulting them in one by
+* one.
+*/
+
+struct startup_profile {
+    uint8_t *binary;            // Key, NULL if the slot is free
+    size_t npages;
+    uintptr_t pages[PROFILE_PAGES];
+};
+
+static struct startup_profile profiles[PROFILE_SLOTS];
+static size_t profile_victim;   // Slot reused next when all are taken
+
+/* Returns the profile of the binary, or NULL if there is none. */
+static struct startup_profile *profile_lookup(uint8_t *binary) {
+    size_t i;
+
+    for (i = 0; i < PROFILE_SLOTS; i++) {
+        if (profiles[i].binary == binary) {
+            return &profiles[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+* Maps the pages in the profile of the binary in the new environment, in
+* one go after load_icode created its VMAs. Stops quietly when running
+* out of memory, the pages are faulted in later then.
+*/
+void profile_prefault(struct env *env, uint8_t *binary) {
+    struct startup_profile *profile = profile_lookup(binary);
+    struct vma *vma;
+    size_t i;
+
+    if (profile == NULL) {
+        return;
+    }
+
+    for (i = 0; i < profile->npages; i++) {
+        vma = vma_lookup(env, (void *) profile->pages[i]);
+        if (vma == NULL || vma->type != VMA_BINARY ||
+            page_lookup(env->env_pml4, (void *) profile->pages[i], NULL) != NULL) {
+            continue;
+        }
+        if (vma_load_page(env, vma, profile->pages[i], 0) < 0) {
+            break;
+        }
+    }
+}
+
+/**
+* Starts recording the pages the new environment touches, into the
+* profile of its binary. The profile is overwritten when the window is
+* over, so it follows the binary as its behaviour changes.
+*/
+void profile_start(struct env *env, uint8_t *binary) {
+    struct startup_profile *profile = profile_lookup(binary);
+
+    if (profile == NULL) {
+        profile = &profiles[profile_victim];
+        profile_victim = (profile_victim + 1) % PROFILE_SLOTS;
+        profile->binary = binary;
+        profile->npages = 0;
+    }
+
+    env->env_profile = profile;
+    env->env_profile_end = read_tsc() + tsc_from_ms(PROFILE_WINDOW_MS);
+}
+
+/* Adds accessed small pages to the profile, for page_walk_range. */
+static int profile_record(physaddr_t *entry, uintptr_t va, void *arg) {
+    struct startup_profile *profile = arg;
+
+    if (!(*entry & PAGE_ACCESSED) || (*entry & PAGE_HUGE)) {
+        return 0;
+    }
+    profile->pages[profile->npages++] = va;
+    return profile->npages == PROFILE_PAGES;
+}
+
+/**
+* Records the profile of the environment once its window is over, or
+* right away if it is exiting. Without a calibrated TSC, the window
+* lasts until the environment exits.
+*/
+void profile_check(struct env *env, int exiting) {
+    struct startup_profile *profile = env->env_profile;
+    struct vma *vma;
+
+    if (profile == NULL) {
+        return;
+    }
+    if (!exiting && (tsc_hz == 0 || read_tsc() < env->env_profile_end)) {
+        return;
+    }
+
+    profile->npages = 0;
+    for (vma = env->vma; vma != NULL && vma->type != VMA_UNUSED; vma = vma->next) {
+        if (vma->type == VMA_BINARY &&
+            page_walk_range(env->env_pml4, (uintptr_t) vma->va,
+                            (uintptr_t) vma->va + vma->len, profile_record, profile) != 0) {
+            break;
+        }
+    }
+
+    env->env_profile = NULL;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <kern/env.h>
+
+/* Profiles kept, and pages per profile. */
+#define PROFILE_SLOTS 16
+#define PROFILE_PAGES 512
+
+/* Pages touched this long after the start of a program are recorded. */
+#define PROFILE_WINDOW_MS 100
+
+void profile_prefault(struct env *env, uint8_t *binary);
+void profile_start(struct env *env, uint8_t *binary);
+void profile_check(struct env *env, int exiting);
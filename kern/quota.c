@@ -0,0 +1,115 @@
+#include <inc/error.h>
+
+#include <inc/x86-64/asm.h>
+
+#include <kern/pmap.h>
+#include <kern/quota.h>
+#include <kern/vma.h>
+
+/**
+* Memory limits: every environment, and every memory group, can have a
+* soft and a hard limit on the pages it maps and on its page table pages
+* (see struct mem_limit). Limits are checked before memory is mapped.
+* Going over a soft limit makes the environment drop its own pages that
+* can be faulted back in unchanged (see vma_reclaim), going over a hard
+* limit refuses the memory with -E_QUOTA.
+*/
+
+/* Limits of the memory groups, group 0 is unused. */
+struct mem_limit quota_groups[MEM_NGROUPS][MEM_NRES];
+
+/**
+* Returns the current use of resource 'res' (MEM_RSS or MEM_PT) by the
+* environment, in pages.
+*/
+uint64_t quota_usage(struct env *env, int res) {
+    if (res == MEM_RSS) {
+        return env->env_mem.rss_pages +
+               env->env_mem.rss_huge * SMALL_PAGES_IN_HUGE;
+    }
+    return env->env_mem.pt_pages;
+}
+
+/* Returns the use of resource 'res' by all environments of the group. */
+static uint64_t quota_group_usage(uint32_t group, int res) {
+    uint64_t usage = 0;
+    size_t i;
+
+    for (i = 0; i < NENV; i++) {
+        if (envs[i].env_status != ENV_FREE && envs[i].env_group == group) {
+            usage += quota_usage(&envs[i], res);
+        }
+    }
+    return usage;
+}
+
+/* Returns by how much 'usage' plus 'need' goes over 'limit' (0 is none). */
+static uint64_t quota_over(uint64_t usage, size_t need, uint64_t limit) {
+    if (limit == 0 || usage + need <= limit) {
+        return 0;
+    }
+    return usage + need - limit;
+}
+
+/**
+* Returns by how many pages the environment would go over its soft
+* (hard == 0) or hard limits on resource 'res' with 'need' more pages,
+* its own or those of its group, whichever is more.
+*/
+static uint64_t quota_excess(struct env *env, int res, size_t need, int hard) {
+    struct mem_limit *limit = &env->env_limit[res];
+    uint64_t over, group_over;
+
+    over = quota_over(quota_usage(env, res), need, hard ? limit->hard : limit->soft);
+
+    if (env->env_group != 0) {
+        limit = &quota_groups[env->env_group][res];
+        if ((hard ? limit->hard : limit->soft) != 0) {
+            group_over = quota_over(quota_group_usage(env->env_group, res), need,
+                                    hard ? limit->hard : limit->soft);
+            over = MAX(over, group_over);
+        }
+    }
+    return over;
+}
+
+/**
+* Returns 1 if 'pages' more mapped pages and 'tables' more page table
+* pages fit under the soft limits of the environment, so mapping them
+* reclaims nothing.
+*/
+int quota_fits(struct env *env, size_t pages, size_t tables) {
+    return quota_excess(env, MEM_RSS, pages, 0) == 0 &&
+           quota_excess(env, MEM_PT, tables, 0) == 0;
+}
+
+/**
+* Makes room for 'pages' more mapped pages of the environment, and the
+* 'tables' page table pages mapping them creates (see
+* page_tables_missing). Over a soft limit, pages of the environment are
+* reclaimed first: as many as it goes over the limit on mapped pages, or
+* a page table's worth for every table it goes over the limit on page
+* tables, hoping to empty them.
+*
+* Returns 0 if the memory may be mapped, -E_QUOTA if that would exceed a
+* hard limit.
+*/
+int quota_charge(struct env *env, size_t pages, size_t tables) {
+    size_t need[MEM_NRES] = { pages, tables };
+    uint64_t over;
+    int res;
+
+    for (res = 0; res < MEM_NRES; res++) {
+        if (need[res] == 0) {
+            continue;
+        }
+        over = quota_excess(env, res, need[res], 0);
+        if (over > 0) {
+            vma_reclaim(env, res == MEM_RSS ? over : over * PAGE_TABLE_ENTRIES);
+        }
+        if (quota_excess(env, res, need[res], 1) > 0) {
+            return -E_QUOTA;
+        }
+    }
+    return 0;
+}
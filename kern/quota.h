@@ -0,0 +1,9 @@
+#pragma once
+
+#include <kern/env.h>
+
+extern struct mem_limit quota_groups[MEM_NGROUPS][MEM_NRES];
+
+int quota_charge(struct env *env, size_t pages, size_t tables);
+int quota_fits(struct env *env, size_t pages, size_t tables);
+uint64_t quota_usage(struct env *env, int res);
@@ -0,0 +1,162 @@
+#include <inc/assert.h>
+#include <inc/stdio.h>
+
+#include <kern/ksm.h>
+#include <kern/monitor.h>
+#include <kern/sched.h>
+
+/**
+* Multilevel feedback queue: a FIFO runqueue of runnable environments per
+* priority level, and a bitmap of the levels with a non-empty queue, so
+* picking the next environment is a find-first-set. The running
+* environment is not queued.
+*
+* New environments start at the highest level. An environment that uses
+* up its timeslice moves one level down and gets the longer timeslice of
+* that level; one that yields or blocks earlier keeps its level and what
+* is left of its slice. Every SCHED_BOOST_TICKS all environments move
+* back to the highest level, so CPU-bound ones are not starved.
+*/
+
+static struct {
+    struct env *head;
+    struct env *tail;
+} sched_queues[SCHED_LEVELS];
+
+static uint32_t sched_bitmap;   // Bit i set if level i has a queued env
+static uint64_t sched_ticks;
+
+/**
+* Appends the environment to the runqueue of its level, if not queued yet.
+*/
+void sched_enqueue(struct env *env) {
+    uint32_t level = env->env_prio;
+
+    if (env->env_queued) {
+        return;
+    }
+
+    env->env_rq_next = NULL;
+    env->env_rq_prev = sched_queues[level].tail;
+    if (sched_queues[level].tail != NULL) {
+        sched_queues[level].tail->env_rq_next = env;
+    } else {
+        sched_queues[level].head = env;
+    }
+    sched_queues[level].tail = env;
+
+    env->env_queued = 1;
+    sched_bitmap |= 1u << level;
+}
+
+/**
+* Removes the environment from its runqueue, if queued.
+*/
+void sched_dequeue(struct env *env) {
+    uint32_t level = env->env_prio;
+
+    if (!env->env_queued) {
+        return;
+    }
+
+    if (env->env_rq_prev != NULL) {
+        env->env_rq_prev->env_rq_next = env->env_rq_next;
+    } else {
+        sched_queues[level].head = env->env_rq_next;
+    }
+    if (env->env_rq_next != NULL) {
+        env->env_rq_next->env_rq_prev = env->env_rq_prev;
+    } else {
+        sched_queues[level].tail = env->env_rq_prev;
+    }
+
+    env->env_rq_next = NULL;
+    env->env_rq_prev = NULL;
+    env->env_queued = 0;
+    if (sched_queues[level].head == NULL) {
+        sched_bitmap &= ~(1u << level);
+    }
+}
+
+/* Moves all environments back to the highest level with a full slice. */
+static void sched_boost(void) {
+    struct env *env;
+    uint32_t level;
+
+    for (level = 1; level < SCHED_LEVELS; level++) {
+        while ((env = sched_queues[level].head) != NULL) {
+            sched_dequeue(env);
+            env->env_prio = 0;
+            env->env_slice = SCHED_QUANTUM(0);
+            sched_enqueue(env);
+        }
+    }
+
+    if (curenv != NULL) {
+        curenv->env_prio = 0;
+        curenv->env_slice = SCHED_QUANTUM(0);
+    }
+}
+
+/**
+* Timer interrupt: charges the tick to the running environment and
+* preempts it when its timeslice is used up, demoting it one level, or
+* when an environment of a higher level is waiting. Also drives the
+* periodic work of the kernel, like page merging.
+*/
+void sched_tick(void) {
+    sched_ticks++;
+    ksm_tick();
+
+    if (curenv == NULL) {
+        return;
+    }
+    curenv->env_cpu_ticks++;
+
+    if (sched_ticks % SCHED_BOOST_TICKS == 0) {
+        sched_boost();
+        sched_yield();
+    }
+
+    if (curenv->env_slice > 1) {
+        curenv->env_slice--;
+        if (sched_bitmap & ((1u << curenv->env_prio) - 1)) {
+            sched_yield();
+        }
+        return;
+    }
+
+    // Used up its whole slice, CPU-bound so far
+    if (curenv->env_prio < SCHED_LEVELS - 1) {
+        curenv->env_prio++;
+    }
+    curenv->env_slice = SCHED_QUANTUM(curenv->env_prio);
+    sched_yield();
+}
+
+/**
+* Runs the first environment of the highest non-empty level. The current
+* environment, if still running, goes to the back of its runqueue (see
+* env_run), or keeps running if nothing else is runnable. Drops into the
+* monitor if no environment is runnable at all.
+*/
+void sched_yield(void) {
+    struct env *next;
+    uint32_t level;
+
+    if (sched_bitmap != 0) {
+        level = __builtin_ctz(sched_bitmap);
+        next = sched_queues[level].head;
+        sched_dequeue(next);
+        assert(next->env_status == ENV_RUNNABLE);
+        env_run(next);
+    }
+
+    if (curenv != NULL && curenv->env_status == ENV_RUNNING) {
+        env_run(curenv);
+    }
+
+    cprintf("No runnable environments in the system!\n");
+    while (1)
+        monitor(NULL);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <kern/env.h>
+
+/* Priority levels, 0 is the highest. */
+#define SCHED_LEVELS 8
+
+/* Timeslice of a level, in timer ticks: doubles with every level down. */
+#define SCHED_QUANTUM(level) (1u << (level))
+
+/* Every this many ticks, all environments go back to the highest level. */
+#define SCHED_BOOST_TICKS 100
+
+void sched_enqueue(struct env *env);
+void sched_dequeue(struct env *env);
+void sched_tick(void);
+void sched_yield(void) __attribute__((noreturn));
@@ -0,0 +1,29 @@
+#include <kern/cpu.h>
+#include <kern/stats.h>
+
+/* Allocated by mem_init and mapped read-only for the user at USER_STATS. */
+struct kern_stats *kern_stats;
+
+/**
+* Records a page fault of the given kind (FAULT_*) that took 'cycles' TSC
+* cycles in the statistics of the current CPU.
+*/
+void stats_fault(int kind, uint64_t cycles) {
+    struct fault_stats *stats;
+    size_t bucket;
+
+    if (kern_stats == NULL) {
+        return;
+    }
+    stats = &kern_stats->faults[thiscpu->cpu_id % STATS_NCPU];
+
+    // Index of the highest bit set
+    bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    if (bucket >= STATS_HIST_BUCKETS) {
+        bucket = STATS_HIST_BUCKETS - 1;
+    }
+
+    stats->count[kind]++;
+    stats->cycles[kind] += cycles;
+    stats->hist[kind][bucket]++;
+}
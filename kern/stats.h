@@ -0,0 +1,7 @@
+#pragma once
+
+#include <inc/stats.h>
+
+extern struct kern_stats *kern_stats;
+
+void stats_fault(int kind, uint64_t cycles);
@@ -12,6 +12,8 @@
 #include <kern/pmap.h>
 #include <kern/syscall.h>
 #include <kern/console.h>
+#include <kern/quota.h>
+#include <kern/sched.h>
 
 #include <kern/vma.h>
 
@@ -85,48 +87,149 @@ static int sys_env_destroy(envid_t envid)
     return 0;
 }
 
+/*
+ * Deschedules the current environment and picks a different one to run, if
+ * any is runnable. Giving up the CPU early keeps its priority level.
+ */
+static void sys_yield(void)
+{
+    sched_yield();
+}
+
+/*
+ * Creates a child of the current environment with a copy-on-write copy of
+ * its address space (see vma_fork) and the same registers, except that
+ * the child returns 0 from the call. The child also inherits the page
+ * fault upcall and the memory limits.
+ *
+ * Returns the envid of the child to the parent, < 0 on error. Errors are:
+ *  -E_NO_FREE_ENV if no free environment is available.
+ *  -E_NO_FREE_VMA, -E_QUOTA, -E_NO_MEM if the address space could not
+ *      be copied.
+ */
+static envid_t sys_fork(void)
+{
+    struct env *child;
+    int r;
+
+    if ((r = env_alloc(&child, curenv->env_id)) < 0) {
+        return r;
+    }
+
+    memcpy(child->env_limit, curenv->env_limit, sizeof(child->env_limit));
+    child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+    if ((r = vma_fork(curenv, child)) < 0) {
+        env_free(child);
+        return r;
+    }
+
+    child->env_frame = curenv->env_frame;
+    child->env_frame.rax = 0;
+
+    return child->env_id;
+}
+
 /*
  * Creates a new anonymous mapping somewhere in the virtual address space.
  *
+ * If 'addr' is not NULL, it is used as a hint for the placement: the mapping
+ * is put there if that range is free, and anywhere else otherwise.
+ * The start of the mapping is a multiple of 'align' (0 means PAGE_SIZE),
+ * which must be a power of two, e.g. 2MB to make the mapping eligible for
+ * huge pages.
+ *
  * Supported flags: 
- *     MAP_POPULATE
+ *     MAP_POPULATE - map all pages right away, fails if they do not fit
+ *         in the memory limits of the environment
+ *     MAP_FIXED - place the mapping exactly at 'addr', which must be aligned,
+ *         fails if the range overlaps with existing mappings
+ *     MAP_SHARED - memory other environments can attach with sys_vma_share,
+ *         always mapped right away
  * 
  * Returns the address to the start of the new mapping, on success,
  * or -1 if request could not be satisfied.
  */
-static void *sys_vma_create(size_t size, int perm, int flags)
+static void *sys_vma_create(size_t size, int perm, int flags, void *addr,
+    size_t align)
 {
     /* Virtual Memory Area allocation */
     /* LAB 4: Your code here. */
-    uintptr_t va;
+    uintptr_t va = (uintptr_t) addr;
     struct vma *new_vma;
 
     // Round up the size
     size_t size_r = ROUNDUP(size, PAGE_SIZE);
 
-    // Find available chunk of virtual memory
-    va = vma_get_vmem(size_r, curenv->vma);
-    if ((long long) va < 0) {
+    if (size_r == 0 || size_r > USER_TOP) {
+        return (void *) -1;
+    }
+
+    // Alignment has to be a power of two of at least a page
+    if (align < PAGE_SIZE) {
+        align = PAGE_SIZE;
+    }
+    if (align & (align - 1)) {
         return (void *) -1;
     }
 
+    // MAP_FIXED: exactly at the given address or not at all
+    if (flags & MAP_FIXED) {
+        if (va % align != 0 || va > USER_TOP - size_r ||
+            !vma_range_free(curenv, va, va + size_r)) {
+            return (void *) -1;
+        }
+    }
+    else {
+        // Use the hint if that part of the address space is still free
+        if (va != 0) {
+            va = ROUNDUP(va, align);
+            if (va > USER_TOP - size_r || !vma_range_free(curenv, va, va + size_r)) {
+                va = 0;
+            }
+        }
+
+        // Find available chunk of virtual memory
+        if (va == 0) {
+            va = vma_get_vmem(size_r, align, curenv->vma);
+            if ((long long) va < 0) {
+                return (void *) -1;
+            }
+        }
+    }
+
     // Insert the new vma
-    new_vma = vma_insert(curenv, VMA_ANON, (void *) va, size, perm | PAGE_USER, NULL, 0);
+    new_vma = vma_insert(curenv, (flags & MAP_SHARED) ? VMA_SHARED : VMA_ANON,
+                         (void *) va, size, perm | PAGE_USER, NULL, 0);
     if (new_vma == NULL) {
         return (void *) -1;
     }
 
     // MAP_POPULATE: Map the whole vma directly into page tables
-    if (flags) {
-        vma_map_populate((uintptr_t) new_vma->va, new_vma->len, perm | PAGE_USER, curenv);
+    // Shared frames have to exist before anyone can attach to them
+    // Undone if it does not fit in the memory limits or in memory
+    if (flags & (MAP_POPULATE | MAP_SHARED)) {
+        if (vma_map_populate((uintptr_t) new_vma->va, new_vma->len,
+                             perm | PAGE_USER, curenv) < 0) {
+            vma_unmap((uintptr_t) new_vma->va, new_vma->len, curenv);
+            vma_make_unused(curenv, new_vma);
+            return (void *) -1;
+        }
     }
 
-    return new_vma->va;
+    // Coalesce with adjacent compatible VMAs to keep the list short
+    vma_merge(curenv, new_vma);
+
+    return (void *) va;
 }
 
 /*
  * Unmaps the specified range of memory starting at 
  * virtual address 'va', 'size' bytes long.
+ * The range may span several VMAs and holes between them: VMAs fully
+ * inside are removed, VMAs crossing an edge are trimmed and a VMA
+ * containing the whole range is split in two. Nothing is changed if
+ * an error is returned.
  */
 static int sys_vma_destroy(void *va, size_t size)
 {
@@ -136,56 +239,693 @@ static int sys_vma_destroy(void *va, size_t size)
     // Round the addresses
     uintptr_t va_start = ROUNDUP((uintptr_t) va, PAGE_SIZE);
     uintptr_t va_end = ROUNDDOWN((uintptr_t) va + size, PAGE_SIZE);
-    size_t size_rounded = (size_t) va_end - va_start;
+    uintptr_t vma_start, vma_end;
+    struct vma *vma, *next;
+    int found = 0;
 
-    struct vma *new_vma;
-    struct vma *vma = vma_lookup(curenv, va);
-    void *va_new;
-    size_t len_new;
+    if (va_end > USER_TOP || va_end < (uintptr_t) va) {
+        return -E_INVAL;
+    }
+    if (va_start >= va_end) {
+        return 0;
+    }
 
-    if (vma == NULL) {
-        panic("VA is not mapped anywhere, cannot unmap\n");
-        return -1;
+    // The kernel data page stays
+    if (va_start < USER_VDSO + PAGE_SIZE && va_end > USER_VDSO) {
+        return -E_INVAL;
     }
-    // Can not destory > 1 VMA at a time
-    else if (va_end > (uintptr_t) vma->va + vma->len) {
-        panic("Trying to unmap memory range spanning more than 1 VMA\n");
-        return -1;
+
+    // Splitting a VMA in two needs an unused VMA, check before changing anything
+    vma = vma_lookup(curenv, (void *) va_start);
+    if (vma != NULL && (uintptr_t) vma->va < va_start &&
+            (uintptr_t) vma->va + vma->len > va_end &&
+            vma_get_last(curenv->vma)->type != VMA_UNUSED) {
+        return -E_NO_FREE_VMA;
     }
 
-    // Destroy 1 whole VMA
-    if (va_start == (uintptr_t) vma->va &&
-             size_rounded == vma->len) {
-        vma_make_unused(curenv, vma);
+    // Huge pages on the edges of the range are split first
+    if (vma_demote_edges(curenv, va_start, va_end) < 0) {
+        return -E_NO_MEM;
     }
 
-    // Destroy part of VMA
-    else {
+    // Remove or trim every VMA overlapping the range, the list is sorted
+    vma = curenv->vma;
+    while (vma != NULL && vma->type != VMA_UNUSED &&
+           (uintptr_t) vma->va < va_end) {
+        next = vma->next;
+        vma_start = (uintptr_t) vma->va;
+        vma_end = vma_start + vma->len;
+
+        if (vma_end <= va_start) {
+            vma = next;
+            continue;
+        }
+        found = 1;
+
+        // Destroy a part in the middle, keep both ends
+        if (vma_start < va_start && vma_end > va_end) {
+            vma_split(curenv, vma, va_end);
+            vma->len = va_start - vma_start;
+        }
+        // Destroy last part, keep first part
+        else if (vma_start < va_start) {
+            vma->len = va_start - vma_start;
+        }
         // Destroy first part, keep second part
-        if (va_start == (uintptr_t) vma->va) {
+        else if (vma_end > va_end) {
             vma->va = (void *) va_end;
-            vma->len -= size_rounded;
-        } 
-        // Destroy last part, keep first part
-        else if (va_end == (uintptr_t) vma->va + vma->len) {
-            vma->len -= size_rounded;
+            vma->len = vma_end - va_end;
         }
-        // Destory a part in the middle
+        // Destroy whole VMA
         else {
-            // Create new vma at end and insert it correctly
-            len_new = ((uintptr_t)vma->va + vma->len) - va_end;
+            vma_make_unused(curenv, vma);
+            vma = next;
+            continue;
+        }
+
+        if (vma->type == VMA_ANON) {
+            vma->mem_va = vma->va;
+            vma->mem_size = vma->len;
+        }
+        vma = next;
+    }
+
+    if (!found) {
+        return -E_INVAL;
+    }
+
+    // Unmap all pages and flush the TLB once
+    vma_unmap(va_start, va_end - va_start, curenv);
+    return 0;
+}
+
+/*
+ * Resizes the anonymous mapping starting at virtual address 'old_va',
+ * 'old_len' bytes long, to 'new_len' bytes. The old range has to lie
+ * within a single anonymous VMA.
+ *
+ * Shrinking unmaps the tail. Growing extends the mapping in place if the
+ * address space right after it is free; otherwise, with MREMAP_MAYMOVE,
+ * the page table entries and the VMA are moved to a new free range, so
+ * the data pages themselves are never copied.
+ *
+ * Returns the (possibly new) address of the mapping on success,
+ * or -1 if request could not be satisfied.
+ */
+static void *sys_vma_remap(void *old_va, size_t old_len, size_t new_len, int flags)
+{
+    uintptr_t va = (uintptr_t) old_va;
+    uintptr_t new_va;
+    size_t old_r = ROUNDUP(old_len, PAGE_SIZE);
+    size_t new_r = ROUNDUP(new_len, PAGE_SIZE);
+    size_t align;
+    struct vma *vma;
+
+    if (va % PAGE_SIZE != 0 || old_r == 0 || new_r == 0 ||
+        old_r > USER_TOP - va || new_r > USER_TOP) {
+        return (void *) -1;
+    }
+
+    vma = vma_lookup(curenv, old_va);
+    if (vma == NULL || vma->type != VMA_ANON ||
+        va + old_r > (uintptr_t) vma->va + vma->len) {
+        return (void *) -1;
+    }
+
+    // Shrink: drop the tail
+    if (new_r <= old_r) {
+        if (new_r < old_r && sys_vma_destroy((void *) (va + new_r), old_r - new_r) < 0) {
+            return (void *) -1;
+        }
+        return old_va;
+    }
+
+    // Grow in place, if the old range ends the VMA and the gap after it fits
+    if (new_r <= USER_TOP - va &&
+        vma_range_free(curenv, va + old_r, va + new_r)) {
+        vma->len += new_r - old_r;
+        vma->mem_size = vma->len;
+        vma_merge(curenv, vma);
+        return old_va;
+    }
+
+    if (!(flags & MREMAP_MAYMOVE)) {
+        return (void *) -1;
+    }
+
+    // Keep the offset within a huge page, so huge pages can move as they are
+    align = (va % PAGE_TABLE_SPAN == 0 && new_r >= PAGE_TABLE_SPAN) ?
+        PAGE_TABLE_SPAN : PAGE_SIZE;
+    new_va = vma_get_vmem(new_r, align, curenv->vma);
+    if ((long long) new_va < 0 && align != PAGE_SIZE) {
+        new_va = vma_get_vmem(new_r, PAGE_SIZE, curenv->vma);
+    }
+    if ((long long) new_va < 0) {
+        return (void *) -1;
+    }
+
+    // Move exactly the old range, the rest of its VMA stays in place
+    if (vma_split_range(curenv, va, va + old_r) < 0) {
+        vma_merge(curenv, vma_lookup(curenv, old_va));
+        return (void *) -1;
+    }
+
+    vma = vma_lookup(curenv, old_va);
+    if (vma_move(curenv, vma, new_va, new_r) == NULL) {
+        vma_merge(curenv, vma);
+        return (void *) -1;
+    }
+
+    return (void *) new_va;
+}
+
+/*
+ * Attaches the shared memory of environment 'envid' in the range starting
+ * at virtual address 'va', 'len' bytes long, to the current environment,
+ * at the same address and with permissions 'perm'. Both environments then
+ * map the same frames, which stay alive as long as anyone maps them.
+ * The range must be page aligned, covered by VMA_SHARED VMAs of envid
+ * that allow 'perm', and free in the current environment.
+ *
+ * Any environment may attach: the owner opted in to sharing by creating
+ * the memory with MAP_SHARED.
+ *
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist.
+ *  -E_INVAL if va is not aligned, perm is invalid, the range is not
+ *      shared by envid or not free in the current environment.
+ *  -E_NO_FREE_VMA if there is no VMA left.
+ *  -E_QUOTA if the range does not fit in the memory limits.
+ *  -E_NO_MEM if a page table could not be allocated.
+ */
+static int sys_vma_share(envid_t envid, void *va, size_t len, int perm)
+{
+    uintptr_t va_start = (uintptr_t) va;
+    uintptr_t va_end = ROUNDUP(va_start + len, PAGE_SIZE);
+    uintptr_t vi;
+    struct env *owner;
+    struct vma *vma;
+    struct page_info *page;
+    int r;
+
+    if (va_start % PAGE_SIZE != 0 || va_end > USER_TOP || va_end <= va_start) {
+        return -E_INVAL;
+    }
+    if (perm & ~(PAGE_PRESENT | PAGE_WRITE)) {
+        return -E_INVAL;
+    }
+    if ((r = envid2env(envid, &owner, 0)) < 0) {
+        return r;
+    }
+    if (owner == curenv) {
+        return -E_INVAL;
+    }
+
+    perm = (perm & PAGE_WRITE) | PAGE_USER;
+
+    // The owner has to share the whole range, with at least these permissions
+    if (!vma_range_mapped(owner, va_start, va_end)) {
+        return -E_INVAL;
+    }
+    for (vma = vma_lookup(owner, va);
+         vma != NULL && vma->type != VMA_UNUSED && (uintptr_t) vma->va < va_end;
+         vma = vma->next) {
+        if (vma->type != VMA_SHARED || (perm & ~vma->perm)) {
+            return -E_INVAL;
+        }
+    }
+
+    if (!vma_range_free(curenv, va_start, va_end)) {
+        return -E_INVAL;
+    }
+    if ((r = quota_charge(curenv, PAGE_INDEX(va_end - va_start),
+                          page_tables_missing(curenv->env_pml4, va_start,
+                                              va_end, 0))) < 0) {
+        return r;
+    }
+    vma = vma_insert(curenv, VMA_SHARED, va, va_end - va_start, perm, NULL, 0);
+    if (vma == NULL) {
+        return -E_NO_FREE_VMA;
+    }
+
+    // Map the frames of the owner, they were populated on creation
+    for (vi = va_start; vi < va_end; vi += PAGE_SIZE) {
+        page = page_lookup(owner->env_pml4, (void *) vi, NULL);
+        if (page != NULL && page_insert(curenv->env_pml4, page, (void *) vi, perm) < 0) {
+            vma_unmap(va_start, vi - va_start, curenv);
+            vma_make_unused(curenv, vma);
+            return -E_NO_MEM;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Rewrites the permissions of a present leaf entry in place.
+ * Used as page_walk_range callback by sys_vma_protect.
+ */
+static int protect_entry(physaddr_t *entry, uintptr_t va, void *arg)
+{
+    struct page_info *page = pa2page(PAGE_ADDR(*entry));
+    int perm = *(int *) arg;
+
+    // Copy-on-write pages stay read-only until written to, and so do the
+    // zero pages, should one ever be mapped without PAGE_COW
+    if ((*entry & PAGE_COW) || page == zero_page || page == zero_huge_page) {
+        perm = (perm & ~PAGE_WRITE) | PAGE_COW;
+    }
+
+    *entry = PAGE_ADDR(*entry) | (*entry & (PAGE_HUGE | PAGE_ACCESSED | PAGE_DIRTY)) |
+             perm | PAGE_PRESENT;
+    return 0;
+}
+
+/*
+ * Changes the permissions of the pages in the range starting at virtual
+ * address 'va', 'size' bytes long, to 'perm'. The range must be page
+ * aligned and completely covered by VMAs. VMAs are split as needed, the
+ * already present pages are updated in place and flushed from the TLB
+ * at once. Afterwards the VMAs are merged back where possible.
+ *
+ * Shared memory can not be made writable again once read-only: an env
+ * that attached it read-only (see sys_vma_share) would get write access
+ * to the frames of the owner.
+ *
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_INVAL if va is not aligned, perm is invalid or the range is not mapped,
+ *      or would make read-only shared memory writable.
+ *  -E_NO_FREE_VMA if the VMAs could not be split.
+ *  -E_NO_MEM if a huge page at the edges could not be split.
+ * Nothing is changed on error.
+ */
+static int sys_vma_protect(void *va, size_t size, int perm)
+{
+    uintptr_t va_start = (uintptr_t) va;
+    uintptr_t va_end = ROUNDUP(va_start + size, PAGE_SIZE);
+    struct vma *vma;
+    int r;
+
+    if (va_start % PAGE_SIZE != 0 || va_end > USER_TOP || va_end < va_start) {
+        return -E_INVAL;
+    }
+    if (perm & ~(PAGE_PRESENT | PAGE_WRITE)) {
+        return -E_INVAL;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    perm |= PAGE_USER;
+
+    // Check the shared VMAs before changing anything
+    if (!vma_range_mapped(curenv, va_start, va_end)) {
+        return -E_INVAL;
+    }
+    vma = vma_lookup(curenv, va);
+    while (vma != NULL && vma->type != VMA_UNUSED && (uintptr_t) vma->va < va_end) {
+        if (vma->type == VMA_SHARED && (perm & ~vma->perm)) {
+            return -E_INVAL;
+        }
+        vma = vma->next;
+    }
+
+    // Make sure the range consists of whole VMAs and whole pages, a
+    // failure leaves the VMAs and the pages as they were
+    if ((r = vma_split_range(curenv, va_start, va_end)) < 0 ||
+        (r = vma_demote_edges(curenv, va_start, va_end)) < 0) {
+        vma_merge_range(curenv, va_start, va_end);
+        return r;
+    }
+
+    // Update the VMAs themselves
+    vma = vma_lookup(curenv, va);
+    while (vma != NULL && vma->type != VMA_UNUSED && (uintptr_t) vma->va < va_end) {
+        // Read-only binary pages may be frames of the kernel image, drop
+        // them so they get copied on the next fault once writable
+        if (vma->type == VMA_BINARY && (perm & PAGE_WRITE) && !(vma->perm & PAGE_WRITE)) {
+            vma_unmap((uintptr_t) vma->va, vma->len, curenv);
+        }
+        vma->perm = perm;
+        vma = vma->next;
+    }
+
+    // Update the pages that are already mapped, flush once
+    page_walk_range(curenv->env_pml4, va_start, va_end, protect_entry, &perm);
+    tlb_invalidate_range(curenv->env_pml4, va_start, va_end);
+
+    // Merge the pieces back with compatible neighbours
+    vma_merge_range(curenv, va_start, va_end);
+
+    return 0;
+}
+
+/*
+ * Gives the kernel advice about the use of the pages in the range starting
+ * at virtual address 'va', 'size' bytes long. The range must be page aligned
+ * and completely covered by VMAs.
+ *
+ * Supported advice:
+ *     MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL - expected access pattern,
+ *         random access turns fault-around off, sequential access maps
+ *         the full fault-around window ahead of the faulting page
+ *     MADV_HUGEPAGE, MADV_NOHUGEPAGE - whether to use huge pages for
+ *         anonymous memory
+ *     MADV_MERGEABLE, MADV_UNMERGEABLE - whether identical anonymous pages
+ *         may be merged by the kernel (see kern/ksm.c), pages merged
+ *         already stay shared until written to
+ *     MADV_USERFAULT, MADV_NOUSERFAULT - whether user page faults in the
+ *         range go straight to the page fault upcall, if one is set
+ *     MADV_WILLNEED - map the missing pages of the range right away
+ *     MADV_DONTNEED - unmap the pages of the range but keep the VMAs,
+ *         the next access gets fresh pages, not allowed for shared memory
+ *
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_INVAL if va is not aligned, advice is unknown or the range is not mapped.
+ *  -E_NO_FREE_VMA if the VMAs could not be split.
+ *  -E_NO_MEM if a huge page could not be split.
+ */
+static int sys_vma_advise(void *va, size_t size, int advice)
+{
+    uintptr_t va_start = (uintptr_t) va;
+    uintptr_t va_end = ROUNDUP(va_start + size, PAGE_SIZE);
+    uintptr_t vi;
+    struct vma *vma;
+    int set, clear;
+    int r;
+
+    if (va_start % PAGE_SIZE != 0 || va_end > USER_TOP || va_end < va_start) {
+        return -E_INVAL;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    if (!vma_range_mapped(curenv, va_start, va_end)) {
+        return -E_INVAL;
+    }
+
+    switch (advice) {
+    case MADV_WILLNEED:
+        // Map everything that is not mapped yet, it is only a hint
+        // so stop quietly when running out of memory. Writable pages are
+        // loaded for writing, or anonymous memory would only get the zero
+        // page. Shared memory was populated on creation.
+        curenv->env_mem.populates++;
+        for (vma = vma_lookup(curenv, va);
+             vma != NULL && vma->type != VMA_UNUSED && (uintptr_t) vma->va < va_end;
+             vma = vma->next) {
+            if (vma->type == VMA_SHARED || vma->type == VMA_VDSO) {
+                continue;
+            }
+            vi = MAX(va_start, (uintptr_t) vma->va);
+            for (; vi < MIN(va_end, (uintptr_t) vma->va + vma->len); vi += PAGE_SIZE) {
+                if (page_lookup(curenv->env_pml4, (void *) vi, NULL) != NULL) {
+                    continue;
+                }
+                if (vma_load_page(curenv, vma, vi, (vma->perm & PAGE_WRITE) != 0) < 0) {
+                    return 0;
+                }
+            }
+        }
+        return 0;
+
+    case MADV_DONTNEED:
+        // Fresh pages would no longer be shared
+        for (vma = vma_lookup(curenv, va);
+             vma != NULL && vma->type != VMA_UNUSED && (uintptr_t) vma->va < va_end;
+             vma = vma->next) {
+            if (vma->type == VMA_SHARED) {
+                return -E_INVAL;
+            }
+        }
+        if ((r = vma_demote_edges(curenv, va_start, va_end)) < 0) {
+            return r;
+        }
+        vma_unmap(va_start, va_end - va_start, curenv);
+        return 0;
+
+    case MADV_NORMAL:
+        set = 0;
+        clear = VMA_ADV_RANDOM | VMA_ADV_SEQUENTIAL;
+        break;
+    case MADV_RANDOM:
+        set = VMA_ADV_RANDOM;
+        clear = VMA_ADV_SEQUENTIAL;
+        break;
+    case MADV_SEQUENTIAL:
+        set = VMA_ADV_SEQUENTIAL;
+        clear = VMA_ADV_RANDOM;
+        break;
+    case MADV_HUGEPAGE:
+        set = VMA_ADV_HUGEPAGE;
+        clear = VMA_ADV_NOHUGEPAGE;
+        break;
+    case MADV_NOHUGEPAGE:
+        set = VMA_ADV_NOHUGEPAGE;
+        clear = VMA_ADV_HUGEPAGE;
+        break;
+    case MADV_MERGEABLE:
+        set = VMA_ADV_MERGEABLE;
+        clear = 0;
+        break;
+    case MADV_UNMERGEABLE:
+        set = 0;
+        clear = VMA_ADV_MERGEABLE;
+        break;
+    case MADV_USERFAULT:
+        set = VMA_ADV_USERFAULT;
+        clear = 0;
+        break;
+    case MADV_NOUSERFAULT:
+        set = 0;
+        clear = VMA_ADV_USERFAULT;
+        break;
+    default:
+        return -E_INVAL;
+    }
+
+    // The advice is stored per VMA, so the range needs whole VMAs
+    if ((r = vma_split_range(curenv, va_start, va_end)) < 0) {
+        return r;
+    }
+
+    vma = vma_lookup(curenv, va);
+    while (vma != NULL && vma->type != VMA_UNUSED && (uintptr_t) vma->va < va_end) {
+        vma->advice = (vma->advice & ~clear) | set;
+        vma = vma->next;
+    }
+
+    // Merge the pieces back with neighbours that got the same advice
+    vma_merge_range(curenv, va_start, va_end);
+
+    return 0;
+}
+
+/*
+ * Sets the maximum number of pages mapped per page fault (fault-around)
+ * for the range starting at virtual address 'va', 'size' bytes long.
+ * The range must be page aligned and completely covered by VMAs.
+ * 'npages' is at most one page table (512 pages); 0 or 1 disables
+ * fault-around. The window used at fault time adapts up to this limit.
+ *
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_INVAL if va is not aligned, npages is invalid or the range is not mapped.
+ *  -E_NO_FREE_VMA if the VMAs could not be split.
+ */
+static int sys_vma_fault_around(void *va, size_t size, int npages)
+{
+    uintptr_t va_start = (uintptr_t) va;
+    uintptr_t va_end = ROUNDUP(va_start + size, PAGE_SIZE);
+    struct vma *vma;
+    int r;
+
+    if (va_start % PAGE_SIZE != 0 || va_end > USER_TOP || va_end < va_start) {
+        return -E_INVAL;
+    }
+    if (npages < 0 || npages > PAGE_TABLE_ENTRIES) {
+        return -E_INVAL;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    if ((r = vma_split_range(curenv, va_start, va_end)) < 0) {
+        return r;
+    }
+
+    vma = vma_lookup(curenv, va);
+    while (vma != NULL && vma->type != VMA_UNUSED && (uintptr_t) vma->va < va_end) {
+        vma->fa_max = npages;
+        vma->fa_pages = npages;
+        vma = vma->next;
+    }
+
+    vma_merge_range(curenv, va_start, va_end);
+
+    return 0;
+}
+
+/*
+ * Sets the page fault upcall of environment 'envid' to 'func'. Page faults
+ * the kernel can't resolve, and all user faults in VMAs advised with
+ * MADV_USERFAULT, are then delivered to 'func' on the exception stack,
+ * the page below UXSTACK_TOP, which is created here if needed. NULL
+ * turns the upcall off again.
+ *
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if the exception stack range is taken by another VMA, or the
+ *      VMA already there is not private, writable memory covering the
+ *      whole page.
+ *  -E_NO_FREE_VMA if there is no VMA left for the exception stack.
+ *  -E_NO_MEM, -E_QUOTA if the exception stack could not be mapped.
+ */
+static int sys_env_set_pgfault_upcall(envid_t envid, void *func)
+{
+    uintptr_t uxstack = UXSTACK_TOP - PAGE_SIZE;
+    struct vma *vma;
+    struct env *e;
+    int r;
+
+    if ((r = envid2env(envid, &e, 1)) < 0) {
+        return r;
+    }
+
+    // Mapped right away, so delivering a fault does not fault again
+    vma = vma_lookup(e, (void *) uxstack);
+    if (func != NULL && vma == NULL) {
+        if (!vma_range_free(e, uxstack, UXSTACK_TOP)) {
+            return -E_INVAL;
+        }
+        vma = vma_insert(e, VMA_ANON, (void *) uxstack, PAGE_SIZE,
+                         PAGE_WRITE | PAGE_USER, NULL, 0);
+        if (vma == NULL) {
+            return -E_NO_FREE_VMA;
+        }
+        if ((r = vma_map_populate(uxstack, PAGE_SIZE, vma->perm, e)) < 0) {
+            vma_unmap(uxstack, PAGE_SIZE, e);
+            vma_make_unused(e, vma);
+            return r;
+        }
+    }
+
+    // An existing exception stack has to take the frames the kernel pushes
+    if (func != NULL &&
+        (vma->type == VMA_SHARED || !(vma->perm & PAGE_WRITE) ||
+         (uintptr_t) vma->va > uxstack ||
+         (uintptr_t) vma->va + vma->len < UXSTACK_TOP)) {
+        return -E_INVAL;
+    }
+
+    e->env_pgfault_upcall = func;
+    return 0;
+}
+
+/* Returns 1 if the limits 'soft' and 'hard' are no higher than 'limit'. */
+static int mem_limit_lowers(struct mem_limit *limit, size_t soft, size_t hard)
+{
+    return (limit->soft == 0 || (soft != 0 && soft <= limit->soft)) &&
+           (limit->hard == 0 || (hard != 0 && hard <= limit->hard));
+}
+
+/*
+ * Sets the soft and hard limits of environment 'envid' on resource
+ * 'resource' (MEM_RSS or MEM_PT), in pages, 0 meaning unlimited.
+ * Limits below the current use take effect at the next mapping.
+ * Only the parent may raise the limits of an environment, the
+ * environment itself may only lower them.
+ *
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if the resource is unknown or soft is above hard.
+ */
+static int sys_mem_limit(envid_t envid, int resource, size_t soft, size_t hard)
+{
+    struct env *e;
+    int r;
 
-            // Fix length of first segment of the VMA
-            vma->len = vma->len - size_rounded - len_new;
+    if ((r = envid2env(envid, &e, 1)) < 0) {
+        return r;
+    }
+    if (resource < 0 || resource >= MEM_NRES || (hard != 0 && soft > hard)) {
+        return -E_INVAL;
+    }
+    if (e == curenv && !mem_limit_lowers(&e->env_limit[resource], soft, hard)) {
+        return -E_BAD_ENV;
+    }
 
-            // Now add the last VMA segment as a new VMA
-            new_vma = vma_insert(curenv, vma->type, (void *)va_end, len_new, vma->perm, NULL, 0);
+    e->env_limit[resource].soft = soft;
+    e->env_limit[resource].hard = hard;
+    return 0;
+}
 
+/*
+ * Moves environment 'envid' to memory group 'group' (0 for none). The
+ * environments it creates afterwards start in the same group. Only the
+ * parent may move an environment, it can't leave its group by itself.
+ *
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller is not its parent.
+ *  -E_INVAL if group is not below MEM_NGROUPS.
+ */
+static int sys_mem_group(envid_t envid, uint32_t group)
+{
+    struct env *e;
+    int r;
+
+    if ((r = envid2env(envid, &e, 1)) < 0) {
+        return r;
+    }
+    if (e == curenv) {
+        return -E_BAD_ENV;
+    }
+    if (group >= MEM_NGROUPS) {
+        return -E_INVAL;
+    }
+
+    e->env_group = group;
+    return 0;
+}
+
+/*
+ * Sets the soft and hard limits of memory group 'group' on resource
+ * 'resource', like sys_mem_limit. They apply to the use of all
+ * environments in the group together. The caller has to be allowed to
+ * change the limits of every member: all have to be its children, but
+ * itself, if it only lowers the limits.
+ *
+ * Returns 0 on success, < 0 on error. Errors are:
+ *  -E_BAD_ENV if the caller may not change the limits of a member.
+ *  -E_INVAL if the group or resource is unknown or soft is above hard.
+ */
+static int sys_mem_group_limit(uint32_t group, int resource, size_t soft,
+    size_t hard)
+{
+    size_t i;
+
+    if (group == 0 || group >= MEM_NGROUPS) {
+        return -E_INVAL;
+    }
+    if (resource < 0 || resource >= MEM_NRES || (hard != 0 && soft > hard)) {
+        return -E_INVAL;
+    }
+
+    for (i = 0; i < NENV; i++) {
+        if (envs[i].env_status == ENV_FREE || envs[i].env_group != group ||
+            envs[i].env_parent_id == curenv->env_id) {
+            continue;
+        }
+        if (&envs[i] != curenv ||
+            !mem_limit_lowers(&quota_groups[group][resource], soft, hard)) {
+            return -E_BAD_ENV;
         }
     }
 
-    // Unmap all pages
-    vma_unmap(va_start, size_rounded, curenv);
+    quota_groups[group][resource].soft = soft;
+    quota_groups[group][resource].hard = hard;
     return 0;
 }
 
@@ -204,8 +944,23 @@ int64_t syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3,
         case SYS_cgetc: return sys_cgetc();
         case SYS_getenvid: return sys_getenvid();
         case SYS_env_destroy: return sys_env_destroy((envid_t) a1);
-        case SYS_vma_create: return (uintptr_t) sys_vma_create((size_t) a1, (int) a2, (int) a3);
+        case SYS_fork: return sys_fork();
+        case SYS_yield: sys_yield(); return 0;
+        case SYS_vma_create: return (uintptr_t) sys_vma_create((size_t) a1, (int) a2, (int) a3,
+            (void *) a4, (size_t) a5);
         case SYS_vma_destroy: return sys_vma_destroy((void *) a1, (size_t) a2);
+        case SYS_vma_remap: return (uintptr_t) sys_vma_remap((void *) a1, (size_t) a2,
+            (size_t) a3, (int) a4);
+        case SYS_vma_share: return sys_vma_share((envid_t) a1, (void *) a2, (size_t) a3, (int) a4);
+        case SYS_vma_protect: return sys_vma_protect((void *) a1, (size_t) a2, (int) a3);
+        case SYS_vma_advise: return sys_vma_advise((void *) a1, (size_t) a2, (int) a3);
+        case SYS_vma_fault_around: return sys_vma_fault_around((void *) a1, (size_t) a2, (int) a3);
+        case SYS_env_set_pgfault_upcall: return sys_env_set_pgfault_upcall((envid_t) a1,
+            (void *) a2);
+        case SYS_mem_limit: return sys_mem_limit((envid_t) a1, (int) a2, (size_t) a3, (size_t) a4);
+        case SYS_mem_group: return sys_mem_group((envid_t) a1, (uint32_t) a2);
+        case SYS_mem_group_limit: return sys_mem_group_limit((uint32_t) a1, (int) a2,
+            (size_t) a3, (size_t) a4);
         default: return -E_NO_SYS;
     }
 }
@@ -0,0 +1,23 @@
+#include <inc/stdio.h>
+
+#include <inc/x86-64/asm.h>
+#include <inc/x86-64/idt.h>
+
+#include <kern/picirq.h>
+#include <kern/timer.h>
+
+/**
+* Programs PIT channel 0 to raise IRQ 0 TIMER_HZ times per second and
+* unmasks it. The interrupts only arrive while an environment runs, the
+* kernel itself runs with interrupts disabled.
+*/
+void timer_init(void) {
+    uint16_t latch = PIT_HZ / TIMER_HZ;
+
+    // Channel 0, low then high byte, mode 2 (rate generator)
+    outb(PIT_CMD, 0x34);
+    outb(PIT_CH0, latch & 0xff);
+    outb(PIT_CH0, latch >> 8);
+
+    irq_setmask_8259A(irq_mask_8259A & ~(1 << (IRQ_TIMER - IRQ_OFFSET)));
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <inc/types.h>
+
+/* The PIT counts at this frequency. Channel 0 raises IRQ 0, channel 2 is
+ * wired to the speaker port. */
+#define PIT_HZ          1193182
+#define PIT_CH0         0x40
+#define PIT_CH2         0x42
+#define PIT_CMD         0x43
+#define PIT_SPEAKER     0x61
+
+/* Timer interrupts per second, the scheduler tick. */
+#define TIMER_HZ        100
+
+void timer_init(void);
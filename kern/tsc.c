@@ -0,0 +1,43 @@
+#include <inc/stdio.h>
+
+#include <inc/x86-64/asm.h>
+
+#include <kern/timer.h>
+#include <kern/tsc.h>
+
+/* How long to count TSC cycles against the PIT. */
+#define TSC_CALIBRATE_MS 10
+
+/* TSC cycles per second, 0 if unknown. */
+uint64_t tsc_hz;
+
+/**
+* Measures the TSC frequency by counting cycles while PIT channel 2 counts
+* down TSC_CALIBRATE_MS milliseconds, polling its output on the speaker
+* port. The speaker itself stays off.
+*/
+void tsc_calibrate(void) {
+    uint64_t start, end;
+    uint16_t latch = PIT_HZ * TSC_CALIBRATE_MS / 1000;
+
+    // Gate channel 2 on, speaker data off
+    outb(PIT_SPEAKER, (inb(PIT_SPEAKER) & ~0x02) | 0x01);
+
+    // Channel 2, low then high byte, mode 0 (output goes high at zero)
+    outb(PIT_CMD, 0xb0);
+    outb(PIT_CH2, latch & 0xff);
+    outb(PIT_CH2, latch >> 8);
+
+    start = read_tsc();
+    while (!(inb(PIT_SPEAKER) & 0x20))
+        ;
+    end = read_tsc();
+
+    tsc_hz = (end - start) * 1000 / TSC_CALIBRATE_MS;
+    cprintf("TSC: %lu MHz\n", tsc_hz / 1000000);
+}
+
+/* Returns the number of TSC cycles in 'ms' milliseconds, 0 if unknown. */
+uint64_t tsc_from_ms(uint64_t ms) {
+    return tsc_hz / 1000 * ms;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <inc/types.h>
+
+extern uint64_t tsc_hz;
+
+void tsc_calibrate(void);
+uint64_t tsc_from_ms(uint64_t ms);
@@ -0,0 +1,58 @@
+#include <inc/error.h>
+
+#include <inc/x86-64/asm.h>
+
+#include <kern/pmap.h>
+#include <kern/tsc.h>
+#include <kern/vdso.h>
+#include <kern/vma.h>
+
+/* Allocated by mem_init and mapped read-only for the user at USER_KDATA. */
+struct vdso_global *vdso_global;
+
+/**
+* Fills in the global kernel data that is known once booting is done.
+*/
+void vdso_init(void) {
+    vdso_global->tsc_hz = tsc_hz;
+    vdso_global->boot_tsc = read_tsc();
+}
+
+/**
+* Maps the page with the kernel data of the environment at USER_VDSO, as
+* a VMA_VDSO VMA the environment can not change or unmap. Called by
+* env_alloc once the environment has its id.
+*
+* Returns 0 on success, -E_NO_FREE_VMA or -E_NO_MEM on error.
+*/
+int vdso_setup(struct env *env) {
+    struct page_info *page;
+    struct vdso_env *data;
+    struct vma *vma;
+
+    vma = vma_insert(env, VMA_VDSO, (void *) USER_VDSO, PAGE_SIZE, PAGE_USER, NULL, 0);
+    if (vma == NULL) {
+        return -E_NO_FREE_VMA;
+    }
+
+    page = page_alloc(ALLOC_ZERO);
+    if (page == NULL) {
+        vma_make_unused(env, vma);
+        return -E_NO_MEM;
+    }
+
+    data = page2kva(page);
+    data->env_id = env->env_id;
+    data->env_parent_id = env->env_parent_id;
+    data->env = (struct env *) USER_ENVS + ENVX(env->env_id);
+    data->global = (struct vdso_global *) USER_KDATA;
+    data->stats = (struct kern_stats *) USER_STATS;
+
+    if (page_insert(env->env_pml4, page, (void *) USER_VDSO, PAGE_USER) != 0) {
+        page_free(page);
+        vma_make_unused(env, vma);
+        return -E_NO_MEM;
+    }
+
+    return 0;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <inc/vdso.h>
+
+#include <kern/env.h>
+
+extern struct vdso_global *vdso_global;
+
+void vdso_init(void);
+int vdso_setup(struct env *env);
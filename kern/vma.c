@@ -1,5 +1,13 @@
+#include <inc/error.h>
+#include <inc/string.h>
+
+#include <inc/x86-64/asm.h>
+
+#include <kern/quota.h>
 #include <kern/vma.h>
 
+static void vma_free_tables(struct env *env, uintptr_t start, uintptr_t end);
+
 /**
 * Removes the specified VMA from the VMAs list
 * of the given environment, i.e. sets the type
@@ -27,12 +35,14 @@ void vma_make_unused(struct env *env, struct vma *vma) {
     }
 
     // Now reset all values and append at end
-    last_vma = vma_get_last(curenv->vma);
+    last_vma = vma_get_last(env->vma);
     vma->va = NULL;
     vma->next = NULL;
     vma->type = VMA_UNUSED;
     vma->prev = last_vma;
     last_vma->next = vma;
+
+    env->env_mem.vmas--;
 }
 
 /**
@@ -62,11 +72,23 @@ struct vma *vma_lookup(struct env *env, void *va) {
     return vma;
 }
 
+/**
+* Returns the lowest address a VMA claims in the address space. That is
+* its start, except for a stack, which also claims the range it may grow
+* into and the guard gap below it.
+*/
+static uintptr_t vma_reserved_start(struct vma *vma) {
+    if (vma->type == VMA_STACK) {
+        return vma->stack_floor - USTACK_GUARD;
+    }
+    return (uintptr_t) vma->va;
+}
+
 /**
 * Inserts a VMA for the specified VA range <va, va+len)
 * into the VMAs list of the specified environment.
 *
-* Possible types:  VMA_ANON / VMA_BINARY (VMA_UNUSED means free)
+* Possible types:  VMA_ANON / VMA_BINARY / VMA_STACK (VMA_UNUSED means free)
 * Fields binary_start and binary_size are only used with
 * binary type and they determine the location and size
 * of the binary data in the memory (in kernel space).
@@ -79,8 +101,6 @@ struct vma *vma_lookup(struct env *env, void *va) {
 */
 struct vma *vma_insert(struct env *env, int type, void *mem_va, size_t mem_size,
     int perm, void *file_va, uint64_t file_size) {
-    cprintf("[VMA_INSERT] start\n");
-
     struct vma *tmp, *new_vma;
     struct vma *vma = env->vma;
 
@@ -100,6 +120,16 @@ struct vma *vma_insert(struct env *env, int type, void *mem_va, size_t mem_size,
     new_vma->va = (void *)va_start;
     new_vma->len = va_end - va_start;
     new_vma->perm = perm;
+    new_vma->advice = 0;
+    new_vma->fa_max = VMA_FAULT_AROUND_PAGES;
+    new_vma->fa_pages = VMA_FAULT_AROUND_PAGES;
+    new_vma->fa_start = 0;
+    new_vma->fa_end = 0;
+    new_vma->fa_fault = 0;
+    new_vma->ra_next = 0;
+    new_vma->ra_pages = 0;
+    new_vma->stack_floor = 0;
+    new_vma->faults = 0;
     new_vma->mem_va = mem_va;
     new_vma->file_va = file_va;
     new_vma->mem_size = mem_size;
@@ -110,11 +140,12 @@ struct vma *vma_insert(struct env *env, int type, void *mem_va, size_t mem_size,
 
     // Insert VMA in VMAs list
     // If all VMAs are unused or the new VMA has the smallest VA, append it in front
-    if (vma->type == VMA_UNUSED || va_end < (uintptr_t) vma->va) {
+    if (vma->type == VMA_UNUSED || va_end <= vma_reserved_start(vma)) {
         vma->prev = new_vma;
         new_vma->next = vma;
         new_vma->prev = NULL;
         env->vma = new_vma;
+        env->env_mem.vmas++;
         return new_vma;
     }
 
@@ -124,7 +155,7 @@ struct vma *vma_insert(struct env *env, int type, void *mem_va, size_t mem_size,
         // 1. vma->end <= new_vma->start
         // 2. new_vma->end <= vma->next->start OR vma->next is unused
         if (((uintptr_t) vma->va + vma->len <= va_start) &&
-            (((vma->next)->type == VMA_UNUSED) || (va_end < (uintptr_t) (vma->next)->va))) {
+            (((vma->next)->type == VMA_UNUSED) || (va_end <= vma_reserved_start(vma->next)))) {
 
             tmp = vma->next;
             vma->next = new_vma;
@@ -132,6 +163,7 @@ struct vma *vma_insert(struct env *env, int type, void *mem_va, size_t mem_size,
             tmp->prev = new_vma;            
             new_vma->next = tmp;
 
+            env->env_mem.vmas++;
             return new_vma;
         }
         vma = vma->next;
@@ -142,40 +174,297 @@ struct vma *vma_insert(struct env *env, int type, void *mem_va, size_t mem_size,
         vma->next = new_vma;
         new_vma->prev = vma;
         new_vma->next = NULL; 
+        env->env_mem.vmas++;
         return new_vma;
     }
 
     // Part of the address range is already in use, couldn' insert VMA
-    cprintf("[VMA_INSERT] could not insert\n");
     return NULL;
 }
 
+/**
+* Returns 1 if VMA 'b' directly follows VMA 'a' and both describe
+* the same kind of memory, so they can be represented by one VMA.
+* Only anonymous VMAs and parts of the same stack are merged: binary
+* VMAs carry their own backing (file_va / mem_va) which cannot be
+* combined.
+*/
+static int vma_can_merge(struct vma *a, struct vma *b) {
+    return a->type == b->type &&
+           (a->type == VMA_ANON ||
+            (a->type == VMA_STACK && a->stack_floor == b->stack_floor)) &&
+           a->perm == b->perm && a->advice == b->advice &&
+           a->fa_max == b->fa_max &&
+           (uintptr_t) a->va + a->len == (uintptr_t) b->va;
+}
+
+/**
+* Coalesces the given VMA with its previous and next VMA in
+* the VMAs list if they are adjacent and compatible.
+* The absorbed VMAs are returned to the unused part of the list.
+*
+* Returns a pointer to the resulting VMA, which might start
+* at a lower address than the VMA that was passed in.
+*/
+struct vma *vma_merge(struct env *env, struct vma *vma) {
+    struct vma *next = vma->next;
+    struct vma *prev = vma->prev;
+
+    // Absorb the next VMA
+    if (next != NULL && next->type != VMA_UNUSED && vma_can_merge(vma, next)) {
+        vma->len += next->len;
+        vma->faults += next->faults;
+        vma_make_unused(env, next);
+    }
+
+    // Let the previous VMA absorb this one
+    if (prev != NULL && vma_can_merge(prev, vma)) {
+        prev->len += vma->len;
+        prev->faults += vma->faults;
+        vma_make_unused(env, vma);
+        vma = prev;
+    }
+
+    // Anonymous memory has no separate destination range
+    if (vma->type == VMA_ANON) {
+        vma->mem_va = vma->va;
+        vma->mem_size = vma->len;
+    }
+
+    return vma;
+}
+
+/**
+* Splits the given VMA at address 'addr' (page aligned, strictly inside
+* the VMA) into <va, addr) and <addr, va+len). The first part stays in
+* 'vma', the second part takes an unused VMA from the end of the list
+* and is linked right after it. Binary VMAs keep their backing fields,
+* the loader only uses them through absolute addresses.
+*
+* Returns a pointer to the second part, or NULL if no VMA is available.
+*/
+struct vma *vma_split(struct env *env, struct vma *vma, uintptr_t addr) {
+    struct vma *new_vma = vma_get_last(env->vma);
+
+    // No available slot - return NULL
+    if (new_vma == NULL || new_vma->type != VMA_UNUSED) {
+        return NULL;
+    }
+
+    // Disconnect VMA from the end of VMA list
+    (new_vma->prev)->next = NULL;
+
+    // Copy everything, then fix up the ranges
+    *new_vma = *vma;
+    new_vma->va = (void *) addr;
+    new_vma->len = (uintptr_t) vma->va + vma->len - addr;
+    new_vma->faults = 0;
+    vma->len = addr - (uintptr_t) vma->va;
+
+    if (vma->type == VMA_ANON) {
+        vma->mem_size = vma->len;
+        new_vma->mem_va = new_vma->va;
+        new_vma->mem_size = new_vma->len;
+    }
+
+    // Link the second part after the first one
+    new_vma->prev = vma;
+    new_vma->next = vma->next;
+    if (vma->next != NULL) {
+        (vma->next)->prev = new_vma;
+    }
+    vma->next = new_vma;
+
+    env->env_mem.vmas++;
+    return new_vma;
+}
+
+/**
+* Returns 1 if every page of the range <start, end) belongs
+* to a VMA, 0 if there is a hole somewhere in the range.
+* The vDSO page counts as a hole, the user may not change it.
+*/
+int vma_range_mapped(struct env *env, uintptr_t start, uintptr_t end) {
+    struct vma *vma = vma_lookup(env, (void *) start);
+    uintptr_t covered;
+
+    if (vma == NULL || vma->type == VMA_VDSO) {
+        return 0;
+    }
+
+    covered = (uintptr_t) vma->va + vma->len;
+    while (covered < end) {
+        vma = vma->next;
+        if (vma == NULL || vma->type == VMA_UNUSED || vma->type == VMA_VDSO ||
+            (uintptr_t) vma->va != covered) {
+            return 0;
+        }
+        covered += vma->len;
+    }
+
+    return 1;
+}
+
+/**
+* Splits the huge pages that straddle the boundaries of the range
+* <start, end) into small pages, so that the range can be unmapped
+* or changed without affecting memory outside of it.
+*
+* Returns 0 on success, < 0 if a huge page could not be split.
+*/
+int vma_demote_edges(struct env *env, uintptr_t start, uintptr_t end) {
+    int r;
+
+    if (start % PAGE_TABLE_SPAN != 0 &&
+        (r = page_demote(env->env_pml4, (void *) start)) < 0) {
+        return r;
+    }
+    if (end % PAGE_TABLE_SPAN != 0 &&
+        (r = page_demote(env->env_pml4, (void *) end)) < 0) {
+        return r;
+    }
+
+    return 0;
+}
+
+/**
+* Moves the VMA to 'new_va' and resizes it to 'new_len' (both page
+* aligned), taking its mappings along without copying any data: only the
+* page table entries move. The range <new_va, new_va+new_len) must be
+* free. Huge pages are kept if the distance of the move is a multiple
+* of the huge page size and split otherwise. Only anonymous VMAs can be
+* moved, binary VMAs locate their backing by address.
+*
+* The page tables of the destination are charged to the environment
+* (see quota_charge) before anything moves.
+*
+* Returns a pointer to the moved VMA, or NULL if the page tables would
+* exceed the memory limits of the environment or could not be
+* allocated, in which case the VMA and its mappings are unchanged.
+*/
+struct vma *vma_move(struct env *env, struct vma *vma, uintptr_t new_va,
+    size_t new_len) {
+    uintptr_t va = (uintptr_t) vma->va;
+    uintptr_t vi;
+    size_t len = MIN(vma->len, new_len);
+    struct vma old = *vma;
+    struct vma *new_vma;
+
+    if (quota_charge(env, 0, page_tables_missing(env->env_pml4, new_va,
+                                                 new_va + len, 0)) < 0) {
+        return NULL;
+    }
+
+    // Huge pages sticking out of the VMA or landing misaligned are split
+    if (vma_demote_edges(env, va, va + vma->len) < 0 ||
+        vma_demote_edges(env, va, va + len) < 0) {
+        return NULL;
+    }
+    if ((new_va - va) % PAGE_TABLE_SPAN != 0) {
+        for (vi = ROUNDUP(va, PAGE_TABLE_SPAN); vi < va + len; vi += PAGE_TABLE_SPAN) {
+            if (page_demote(env->env_pml4, (void *) vi) < 0) {
+                return NULL;
+            }
+        }
+    }
+
+    if (page_move_range(env->env_pml4, va, new_va, len) < 0) {
+        return NULL;
+    }
+
+    // Anything past the new length is dropped, the old tables are freed
+    if (new_len < vma->len) {
+        vma_unmap(va + new_len, vma->len - new_len, env);
+    }
+    vma_free_tables(env, va, va + old.len);
+    tlb_invalidate_range(env->env_pml4, va, va + old.len);
+
+    // Reuse the same VMA slot at the new place in the list
+    vma_make_unused(env, vma);
+    new_vma = vma_insert(env, old.type, (void *) new_va, new_len, old.perm, NULL, 0);
+    new_vma->advice = old.advice;
+    new_vma->fa_max = old.fa_max;
+    new_vma->fa_pages = old.fa_pages;
+    new_vma->faults = old.faults;
+
+    return vma_merge(env, new_vma);
+}
+
+/**
+* Makes sure that the range <start, end) (page aligned) is covered by
+* whole VMAs only, by splitting the VMAs that contain start and end.
+*
+* Returns 0 on success, -E_INVAL if part of the range is not covered
+* by any VMA, or -E_NO_FREE_VMA if there is no VMA left for a split.
+* Nothing is changed if the range is not covered.
+*/
+int vma_split_range(struct env *env, uintptr_t start, uintptr_t end) {
+    struct vma *vma;
+
+    // Check that the VMAs cover the range without holes
+    if (!vma_range_mapped(env, start, end)) {
+        return -E_INVAL;
+    }
+
+    // Split at the start
+    vma = vma_lookup(env, (void *) start);
+    if ((uintptr_t) vma->va < start && vma_split(env, vma, start) == NULL) {
+        return -E_NO_FREE_VMA;
+    }
+
+    // Split at the end
+    vma = vma_lookup(env, (void *) (end - 1));
+    if ((uintptr_t) vma->va + vma->len > end && vma_split(env, vma, end) == NULL) {
+        return -E_NO_FREE_VMA;
+    }
+
+    return 0;
+}
+
+/**
+* Merges the VMAs covering part of <start, end) with their neighbours
+* where compatible, undoing the splits of vma_split_range once the
+* pieces were changed, or if changing them failed.
+*/
+void vma_merge_range(struct env *env, uintptr_t start, uintptr_t end) {
+    struct vma *vma = vma_lookup(env, (void *) start);
+
+    while (vma != NULL && vma->type != VMA_UNUSED && (uintptr_t) vma->va < end) {
+        vma = vma_merge(env, vma);
+        vma = vma->next;
+    }
+}
+
 // MATTHIJS: Something can go wrong if forgot some mem you shouldnt use
-// Find a free piece of virt mem of size size
-// assumes size to be aligned
+// Find a free piece of virt mem of size size, starting at a multiple of align
+// assumes size to be aligned and align to be a power of two >= PAGE_SIZE
 // returns -1 if there is no free slot or no contiguous region
-uintptr_t vma_get_vmem(size_t size, struct vma *vma) {
+uintptr_t vma_get_vmem(size_t size, size_t align, struct vma *vma) {
+    uintptr_t start;
+
     // Get virt mem before first vma or at 0 if empty
     if (vma->type == VMA_UNUSED) {
         return 0;
-    } else if (size <= (uintptr_t) vma->va) {
-        return (uintptr_t) vma->va - size;
+    } else if (size <= vma_reserved_start(vma)) {
+        return ROUNDDOWN(vma_reserved_start(vma) - size, align);
     }
 
     while (vma->next != NULL) {
+        start = ROUNDUP((uintptr_t) vma->va + vma->len, align);
+
         // Append to end of list
         if ((vma->next)->type == VMA_UNUSED) {
             // Not enough space to KERNEL_VMA
-            if (size > USER_TOP - ROUNDUP((uintptr_t) vma->va + vma->len, PAGE_SIZE)) {
+            if (start > USER_TOP || size > USER_TOP - start) {
                 break;
             } else {
-                return ROUNDUP((uintptr_t) vma->va + vma->len, PAGE_SIZE);
+                return start;
             }
         }
         // Found a hole after this vma
-        else if (size <= (uintptr_t) (vma->next)->va - 
-                 ROUNDUP((uintptr_t) vma->va + vma->len, PAGE_SIZE)) {
-            return ROUNDUP((uintptr_t) vma->va + vma->len, PAGE_SIZE);
+        else if (start <= vma_reserved_start(vma->next) &&
+                 size <= vma_reserved_start(vma->next) - start) {
+            return start;
         }
 
         vma = vma->next;
@@ -184,108 +473,857 @@ uintptr_t vma_get_vmem(size_t size, struct vma *vma) {
     return -1;
 }
 
+/**
+* Returns 1 if no VMA of the environment overlaps with the range
+* <start, end), 0 otherwise. The range a stack may grow into, and its
+* guard gap, count as used.
+*/
+int vma_range_free(struct env *env, uintptr_t start, uintptr_t end) {
+    struct vma *vma = env->vma;
+
+    while (vma != NULL && vma->type != VMA_UNUSED) {
+        if (vma_reserved_start(vma) < end && start < (uintptr_t) vma->va + vma->len) {
+            return 0;
+        }
+        vma = vma->next;
+    }
+
+    return 1;
+}
+
+/**
+* Inserts a stack VMA ending at 'top'. It starts with a single page and
+* grows down on demand (see vma_stack_grow) as far as USTACK_SIZE below
+* 'top'. That range and the USTACK_GUARD bytes below it are reserved,
+* so no other VMA can be placed there.
+*
+* Returns a pointer to the new VMA, or NULL if the reserved range is not
+* free or no VMA is available.
+*/
+struct vma *vma_insert_stack(struct env *env, uintptr_t top) {
+    uintptr_t floor = top - USTACK_SIZE;
+    struct vma *vma;
+
+    if (!vma_range_free(env, floor - USTACK_GUARD, top)) {
+        return NULL;
+    }
+
+    vma = vma_insert(env, VMA_STACK, (void *) (top - PAGE_SIZE), PAGE_SIZE,
+                     PAGE_WRITE | PAGE_USER, NULL, 0);
+    if (vma != NULL) {
+        vma->stack_floor = floor;
+    }
+    return vma;
+}
+
+/**
+* Grows a stack VMA down so that it covers 'va', if 'va' lies between
+* the lowest VMA of a stack and its floor. Addresses in the guard gap
+* below the floor are not part of any stack.
+*
+* Returns the grown VMA, or NULL if 'va' does not belong to a stack.
+*/
+struct vma *vma_stack_grow(struct env *env, uintptr_t va) {
+    struct vma *vma = env->vma;
+
+    // First VMA above the address
+    while (vma != NULL && vma->type != VMA_UNUSED &&
+           (uintptr_t) vma->va + vma->len <= va) {
+        vma = vma->next;
+    }
+
+    if (vma == NULL || vma->type != VMA_STACK ||
+        va >= (uintptr_t) vma->va || va < vma->stack_floor) {
+        return NULL;
+    }
+
+    va = ROUNDDOWN(va, PAGE_SIZE);
+    vma->len += (uintptr_t) vma->va - va;
+    vma->va = (void *) va;
+    return vma;
+}
+
 /**
 * Allocates memory for region <va, va+size) and maps it in the pml4 of
 * the given environment with the given permissions.
 * Assumes size is already rounded to PAGE_SIZE.
-* Panics if there is not enough physical memory to allocate.
+*
+* Returns 0 on success, -E_QUOTA if the region does not fit in the memory
+* limits of the environment, -E_NO_MEM if out of memory. On failure, part
+* of the region may be mapped.
 */
-void vma_map_populate(uintptr_t va, size_t size, int perm, struct env *env) {
+int vma_map_populate(uintptr_t va, size_t size, int perm, struct env *env) {
     uintptr_t virt_addr = va;
     struct page_info *page;
+    size_t tables;
+    int r;
+
+    env->env_mem.populates++;
+
+    tables = page_tables_missing(env->env_pml4, va, va + size, 0);
+    if ((r = quota_charge(env, PAGE_INDEX(size), tables)) < 0) {
+        return r;
+    }
 
     // Alloc physical page for each virt mem page and map it
     while (virt_addr < va + size) {
         page = page_alloc(ALLOC_ZERO);
         if (page == NULL) {
-            panic("Out of memory in VMA_MAP_POPULATE");
+            return -E_NO_MEM;
         }
         if (page_insert(env->env_pml4, page, (void *) virt_addr, perm) != 0) {
-            panic("Could not map whole VMA in page tables with flag MAP_POPULATE\n");
+            page_free(page);
+            return -E_NO_MEM;
         }
         virt_addr += PAGE_SIZE;
     }
+    return 0;
 }
 
 /**
-* Unmaps the given range of virtual addresses from the environment
-* page tables, possibly destroys page tables / page directories /
-* page directory pointers and frees physical pages if necessary.
-* Assume aligned addresses.
+* Returns the permissions to map a frame shared with others with, in a
+* VMA with permissions 'perm': read-only and copy-on-write, also if the
+* VMA is read-only, so that making the VMA writable later (see
+* sys_vma_protect) still copies the frame on the first write.
 */
-void vma_unmap(uintptr_t va, size_t size, struct env *env) {
-    uintptr_t vi;
+int vma_shared_perm(int perm) {
+    return (perm & ~PAGE_WRITE) | PAGE_COW;
+}
+
+/**
+* Maps a zeroed huge page for the 2MB block containing 'va', if the VMA
+* asked for huge pages, the whole block lies inside the VMA and no
+* page table exists for the block yet. For a read, that is the shared
+* zero huge page.
+*
+* Returns 1 if a huge page was mapped, 0 if a small page should be used.
+*/
+static int vma_load_huge_page(struct env *env, struct vma *vma, uintptr_t va,
+    int write) {
+    uintptr_t block = ROUNDDOWN(va, PAGE_TABLE_SPAN);
     struct page_info *page;
-    struct page_table *pdp = NULL;
-    struct page_table *pd = NULL;
-    struct page_table *pt = NULL;
+    physaddr_t *pde;
+
+    if (vma->type != VMA_ANON || !(vma->advice & VMA_ADV_HUGEPAGE)) {
+        return 0;
+    }
+
+    // The whole block has to belong to this VMA
+    if (block < (uintptr_t) vma->va ||
+        block + PAGE_TABLE_SPAN > (uintptr_t) vma->va + vma->len) {
+        return 0;
+    }
+
+    // Part of the block is already mapped with small pages
+    pde = page_walk_pde(env->env_pml4, (void *) block);
+    if (pde != NULL && (*pde & PAGE_PRESENT)) {
+        return 0;
+    }
+
+    if (quota_charge(env, SMALL_PAGES_IN_HUGE,
+                     page_tables_missing(env->env_pml4, block,
+                                         block + PAGE_TABLE_SPAN, 1)) < 0) {
+        return 0;
+    }
+
+    if (!write && zero_huge_page != NULL) {
+        return page_insert(env->env_pml4, zero_huge_page, (void *) block,
+                           vma_shared_perm(vma->perm) | PAGE_HUGE) == 0;
+    }
+
+    page = page_alloc(ALLOC_HUGE | ALLOC_ZERO);
+    if (page == NULL) {
+        return 0;
+    }
+
+    if (page_insert(env->env_pml4, page, (void *) block, vma->perm | PAGE_HUGE) != 0) {
+        page_free(page);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+* Returns the frame of the ELF binary embedded in the kernel image that
+* backs the page at 'va' of a binary VMA, if the page is entirely backed
+* by the file and lines up with a page of the binary (the binaries are
+* page aligned by kernel.ld), or NULL otherwise.
+*/
+static struct page_info *vma_binary_frame(struct vma *vma, uintptr_t va) {
+    uintptr_t mem_start = (uintptr_t) vma->mem_va;
+    uintptr_t src = (uintptr_t) vma->file_va + (va - mem_start);
+
+    if (vma->type != VMA_BINARY ||
+        va < mem_start || va + PAGE_SIZE > mem_start + vma->file_size ||
+        src % PAGE_SIZE != 0) {
+        return NULL;
+    }
+
+    return pa2page(PADDR((void *) src));
+}
+
+/**
+* Maps the page at 'va' of a binary VMA directly to the frame of the ELF
+* binary embedded in the kernel image, if there is one (see
+* vma_binary_frame). The frame is shared by all environments running
+* the binary; page_init pins it so it is never freed. Pages of writable
+* segments are mapped copy-on-write, unless the fault is a write, which
+* needs a private copy right away.
+*
+* Returns 1 if the page was mapped, 0 if it has to be copied.
+*/
+static int vma_load_binary_frame(struct env *env, struct vma *vma, uintptr_t va,
+    int write) {
+    struct page_info *frame = vma_binary_frame(vma, va);
+
+    if (frame == NULL || (write && (vma->perm & PAGE_WRITE))) {
+        return 0;
+    }
+
+    return page_insert(env->env_pml4, frame, (void *) va,
+                       vma_shared_perm(vma->perm)) == 0;
+}
+
+/**
+* Allocates a physical page for the page at 'va' (aligned) of the given
+* VMA and maps it in the page tables of the given environment.
+* Anonymous memory is zero-filled, binary memory is copied from the
+* ELF binary in kernel space, or shared with it until written to (see
+* vma_load_binary_frame). 'write' tells whether the page is loaded for a
+* write access. Reads of anonymous memory map the shared zero page until
+* the first write. Anonymous VMAs that asked for huge pages get a whole
+* huge page where possible.
+*
+* Returns 0 on success, -E_QUOTA if over the memory limits of the
+* environment, -E_NO_MEM if out of memory.
+*/
+int vma_load_page(struct env *env, struct vma *vma, uintptr_t va, int write) {
+    struct page_info *page;
+    size_t tables;
+    int r;
+
+    if (vma_load_huge_page(env, vma, va, write)) {
+        return 0;
+    }
+    tables = page_tables_missing(env->env_pml4, va, va + PAGE_SIZE, 0);
+    if ((r = quota_charge(env, 1, tables)) < 0) {
+        return r;
+    }
+    if (vma_load_binary_frame(env, vma, va, write)) {
+        return 0;
+    }
+
+    if (vma->type == VMA_ANON && !write) {
+        if (page_insert(env->env_pml4, zero_page, (void *) va,
+                        vma_shared_perm(vma->perm)) != 0) {
+            return -E_NO_MEM;
+        }
+        return 0;
+    }
+
+    page = page_alloc(ALLOC_ZERO);
+    if (page == NULL) {
+        return -E_NO_MEM;
+    }
+
+    // Copy the binary from kernel space into the new frame through its
+    // kernel address, before it is mapped, for anonymous memory nothing
+    // more has to be done
+    if (vma->type == VMA_BINARY) {
+        // Alligned start and end in userspace (dest)
+        uintptr_t va_aligned_start = va;
+        uintptr_t va_aligned_end = va + PAGE_SIZE;
+
+        // Not alligned start and end of binary in kernel space
+        uintptr_t va_file_start = (uintptr_t) vma->file_va;
+        uintptr_t va_file_end = (uintptr_t) vma->file_va + vma->file_size;
+
+        // Not alligned start and end in userspace (dest)
+        uintptr_t va_mem_start = (uintptr_t) vma->mem_va;
+        uintptr_t va_mem_end = (uintptr_t) vma->mem_va + vma->mem_size;
+
+        uintptr_t va_src_start;
+        uintptr_t va_src_end;
+        uintptr_t va_dst_start;
+        uintptr_t va_dst_end;
+
+        uint64_t offset = va_file_start - va_mem_start;
+
+        // Not alligned dest in user mem can not be before start of alligned page
+        va_dst_start = (va_mem_start < va_aligned_start) ? va_aligned_start : va_mem_start;
+
+        // Not alligned dest in user mem can not be after aligned end page
+        va_dst_end = (va_mem_end > va_aligned_end) ? va_aligned_end : va_mem_end;
+
+        // Source start cannot be before file start
+        va_src_start = (va_file_start < va_aligned_start + offset) ? va_aligned_start + offset : va_file_start;
+
+        // Source end cannot be after file end
+        va_src_end = (va_file_end > va_aligned_end + offset) ? va_aligned_end + offset : va_file_end;
+
+        // Allocated zeros otherwise
+        if (va_src_start < va_src_end) {
+            uint64_t src_size = va_src_end - va_src_start;
+            uint64_t dst_size = va_dst_end - va_dst_start;
+            uint64_t copy_size = (src_size < dst_size) ? src_size : dst_size;
+
+            memcpy((uint8_t *) page2kva(page) + (va_dst_start - va_aligned_start),
+                   (void *) va_src_start, copy_size);
+        }
+    }
+
+    if (page_insert(env->env_pml4, page, (void *) va, vma->perm) != 0) {
+        page_free(page);
+        return -E_NO_MEM;
+    }
+
+    return 0;
+}
+
+/**
+* Resolves a write to the copy-on-write page at 'va' (aligned) of the
+* given VMA: the page is copied to a new frame that is mapped with the
+* permissions of the VMA. If the environment holds the only reference
+* to the frame, the mapping is just made writable instead. Copies of the
+* zero pages are just zeroed. If no huge page is left to replace the
+* zero huge page, the block falls back to small pages.
+*
+* Returns 0 on success, -E_INVAL if the page is not copy-on-write or the
+* VMA is not writable, -E_NO_MEM if out of memory.
+*/
+int vma_cow_page(struct env *env, struct vma *vma, uintptr_t va) {
+    uintptr_t block = ROUNDDOWN(va, PAGE_TABLE_SPAN);
+    struct page_info *old, *page;
     physaddr_t *entry;
-    int is_empty = 1;
-    int i;
 
-    // Remove and unmap the actual entries
-    for (vi = va; vi < va + size; vi += PAGE_SIZE) {
-        page_remove(env->env_pml4, (void *)vi);
-    }
-
-    // Start to remove page tables, then page dir tables, then page dir pointer tables
-    for (i = 0; i < 3; i++) {
-        // For each virtual address, get each page table and check if its empty
-        // If its empty, delete that table and set the entry to 0 in the tlb
-        for (vi = va; vi < va + size; vi += PAGE_SIZE) {
-            // Pml4 entry
-            entry = (env->env_pml4)->entries + PML4_INDEX((uintptr_t) va);
-            if (!(*entry & PAGE_PRESENT)) {
+    old = page_lookup(env->env_pml4, (void *) va, &entry);
+    if (old == NULL || !(*entry & PAGE_COW) || !(vma->perm & PAGE_WRITE)) {
+        return -E_INVAL;
+    }
+
+    // Nobody left to share the frame with
+    if (old->pp_ref == 1) {
+        *entry = (*entry & ~(physaddr_t) PAGE_COW) | PAGE_WRITE;
+        tlb_invalidate(env->env_pml4, (void *) va);
+        return 0;
+    }
+
+    if (*entry & PAGE_HUGE) {
+        page = page_alloc(ALLOC_HUGE | (old == zero_huge_page ? ALLOC_ZERO : 0));
+        if (page == NULL && old == zero_huge_page) {
+            page_remove(env->env_pml4, (void *) block);
+            return vma_load_page(env, vma, va, 1);
+        }
+        if (page == NULL) {
+            return -E_NO_MEM;
+        }
+        if (old != zero_huge_page) {
+            memcpy(page2kva(page), page2kva(old), PAGE_TABLE_SPAN);
+        }
+        if (page_insert(env->env_pml4, page, (void *) block, vma->perm | PAGE_HUGE) != 0) {
+            page_free(page);
+            return -E_NO_MEM;
+        }
+        return 0;
+    }
+
+    page = page_alloc(old == zero_page ? ALLOC_ZERO : 0);
+    if (page == NULL) {
+        return -E_NO_MEM;
+    }
+    if (old != zero_page) {
+        memcpy(page2kva(page), page2kva(old), PAGE_SIZE);
+    }
+
+    // Replaces the shared frame and drops its reference
+    if (page_insert(env->env_pml4, page, (void *) va, vma->perm) != 0) {
+        page_free(page);
+        return -E_NO_MEM;
+    }
+
+    return 0;
+}
+
+struct vma_fork_args {
+    struct env *child;
+    int shared;         // VMA_SHARED frames stay writable in both
+};
+
+/**
+* Maps the frame of a present leaf entry of the parent in the child as
+* well, for page_walk_range. Frames become read-only and copy-on-write
+* in both, also in read-only VMAs, so whoever writes first, possibly
+* after sys_vma_protect, gets its own copy (see vma_cow_page). Only the
+* zero huge page is still mapped huge (see vma_fork_demote). The dirty
+* bit is kept.
+*/
+static int vma_fork_entry(physaddr_t *entry, uintptr_t va, void *arg) {
+    struct vma_fork_args *args = arg;
+    struct page_info *page = pa2page(PAGE_ADDR(*entry));
+    int perm = *entry & (PAGE_WRITE | PAGE_USER | PAGE_HUGE | PAGE_COW |
+                         PAGE_DIRTY);
+
+    if (!args->shared) {
+        perm = (perm & ~PAGE_WRITE) | PAGE_COW;
+        *entry = (*entry & ~(physaddr_t) PAGE_WRITE) | PAGE_COW;
+    }
+
+    return page_insert(args->child->env_pml4, page, (void *) va, perm);
+}
+
+/**
+* Splits the huge pages the parent maps in <start, end) before they are
+* shared with the child: page_demote can only split a huge page that is
+* mapped once, and either of them may unmap or protect part of it later.
+* The zero huge page can always be split, it is shared whole.
+*
+* Returns 0 on success, -E_NO_MEM if no page table could be allocated.
+*/
+static int vma_fork_demote(struct env *parent, uintptr_t start, uintptr_t end) {
+    uintptr_t block;
+    physaddr_t *pde;
+    int r;
+
+    for (block = ROUNDDOWN(start, PAGE_TABLE_SPAN); block < end;
+         block += PAGE_TABLE_SPAN) {
+        pde = page_walk_pde(parent->env_pml4, (void *) block);
+        if (pde == NULL || !(*pde & PAGE_PRESENT) || !(*pde & PAGE_HUGE) ||
+            pa2page(PAGE_ADDR(*pde)) == zero_huge_page) {
+            continue;
+        }
+        if ((r = page_demote(parent->env_pml4, (void *) block)) < 0) {
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+/**
+* Gives the child a copy of the address space of the parent: the same
+* VMAs, and the frames mapped so far shared copy-on-write, huge pages
+* split into small ones. No data is copied, only page table entries; pages not faulted in yet are loaded
+* by whoever touches them. The child must not have any VMA yet.
+*
+* Returns 0 on success, -E_NO_FREE_VMA, -E_QUOTA or -E_NO_MEM on error,
+* in which case the child is left half-copied and should be freed.
+*/
+int vma_fork(struct env *parent, struct env *child) {
+    struct vma_fork_args args = { child, 0 };
+    struct vma *vma, *copy, *next, *prev;
+    uintptr_t start, end;
+    int r;
+
+    // The child needs about as many page tables as the parent has
+    r = quota_charge(child, parent->env_mem.rss_pages +
+                     parent->env_mem.rss_huge * SMALL_PAGES_IN_HUGE,
+                     parent->env_mem.pt_pages > child->env_mem.pt_pages ?
+                     parent->env_mem.pt_pages - child->env_mem.pt_pages : 0);
+    if (r < 0) {
+        return r;
+    }
+
+    for (vma = parent->vma; vma != NULL && vma->type != VMA_UNUSED; vma = vma->next) {
+        // The child has a kernel data page of its own
+        if (vma->type == VMA_VDSO) {
+            continue;
+        }
+
+        // The list is sorted, so each VMA is inserted in order
+        copy = vma_insert(child, vma->type, vma->va, vma->len, vma->perm, NULL, 0);
+        if (copy == NULL) {
+            return -E_NO_FREE_VMA;
+        }
+        next = copy->next;
+        prev = copy->prev;
+        *copy = *vma;
+        copy->next = next;
+        copy->prev = prev;
+        copy->faults = 0;
+
+        start = (uintptr_t) vma->va;
+        end = start + vma->len;
+        args.shared = (vma->type == VMA_SHARED);
+        if ((r = vma_fork_demote(parent, start, end)) < 0) {
+            return r;
+        }
+        r = page_walk_range(parent->env_pml4, start, end, vma_fork_entry, &args);
+        if (r < 0) {
+            tlb_invalidate_range(parent->env_pml4, start, end);
+            return r;
+        }
+        tlb_invalidate_range(parent->env_pml4, start, end);
+    }
+
+    return 0;
+}
+
+/* Counts present entries with the accessed bit set, for page_walk_range. */
+static int vma_count_accessed(physaddr_t *entry, uintptr_t va, void *arg) {
+    if (*entry & PAGE_ACCESSED) {
+        (*(size_t *) arg)++;
+    }
+    return 0;
+}
+
+/**
+* Adapts the fault-around window of the VMA to the use of the pages that
+* were mapped around the previous fault: if at least half of them have
+* been accessed since, the window doubles (up to fa_max), if less than a
+* quarter was accessed, it halves (down to VMA_FAULT_AROUND_MIN).
+*/
+static void vma_fault_around_adapt(struct env *env, struct vma *vma) {
+    size_t candidates, used = 0;
+    physaddr_t *entry;
+
+    if (vma->fa_end <= vma->fa_start) {
+        return;
+    }
+
+    // The faulting page itself was not mapped ahead of time
+    page_walk_range(env->env_pml4, vma->fa_start, vma->fa_end,
+        vma_count_accessed, &used);
+    if (page_lookup(env->env_pml4, (void *) vma->fa_fault, &entry) != NULL &&
+        (*entry & PAGE_ACCESSED) && used > 0) {
+        used--;
+    }
+    candidates = PAGE_INDEX(vma->fa_end - vma->fa_start) - 1;
+
+    if (used * 2 >= candidates) {
+        vma->fa_pages *= 2;
+    } else if (used * 4 < candidates) {
+        vma->fa_pages /= 2;
+    }
+
+    if (vma->fa_pages > vma->fa_max) {
+        vma->fa_pages = vma->fa_max;
+    }
+    if (vma->fa_pages < VMA_FAULT_AROUND_MIN) {
+        vma->fa_pages = VMA_FAULT_AROUND_MIN;
+    }
+}
+
+/**
+* Fault-around: after the page at 'va' has been loaded, also map the
+* missing neighbouring pages within the same VMA and page table, so that
+* the next accesses to them don't trap.
+*
+* The window is vma->fa_pages pages, aligned, and adapts to how much of
+* the previous window has been used. With sequential advice the window
+* covers fa_max pages starting at 'va', with random advice fault-around
+* is off. Stacks use a window ending at 'va' instead, and grow down into
+* their reserved range to cover it. The pages are loaded for the same
+* kind of access as the faulting one. Stops quietly when running out of
+* memory, and does nothing if the window does not fit under the soft
+* memory limits, as reclaiming pages for it could drop the faulting page.
+*/
+void vma_fault_around(struct env *env, struct vma *vma, uintptr_t va, int write) {
+    uintptr_t block = ROUNDDOWN(va, PAGE_TABLE_SPAN);
+    uintptr_t vma_end = (uintptr_t) vma->va + vma->len;
+    uintptr_t start, end, vi;
+    struct page_table *pt;
+    physaddr_t *pde;
+    size_t window;
+
+    if ((vma->advice & VMA_ADV_RANDOM) || vma->fa_max < VMA_FAULT_AROUND_MIN) {
+        return;
+    }
+
+    // Only small pages, the fault was served by a huge page otherwise
+    pde = page_walk_pde(env->env_pml4, (void *) va);
+    if (pde == NULL || !(*pde & PAGE_PRESENT) || (*pde & PAGE_HUGE)) {
+        return;
+    }
+    pt = (struct page_table *)KADDR(PAGE_ADDR(*pde));
+
+    // Determine the window
+    if (vma->type == VMA_STACK) {
+        vma_fault_around_adapt(env, vma);
+        window = vma->fa_pages;
+        start = va + PAGE_SIZE - window * PAGE_SIZE;
+    } else if (vma->advice & VMA_ADV_SEQUENTIAL) {
+        window = vma->fa_max;
+        start = va;
+    } else {
+        vma_fault_around_adapt(env, vma);
+        window = vma->fa_pages;
+        start = ROUNDDOWN(va, window * PAGE_SIZE);
+    }
+    end = start + window * PAGE_SIZE;
+
+    // Stacks grow down into the window, without leaving the page table
+    if (vma->type == VMA_STACK) {
+        start = MAX(start, MAX(vma->stack_floor, block));
+        if (vma->prev != NULL) {
+            start = MAX(start, (uintptr_t) vma->prev->va + vma->prev->len);
+        }
+        if (start < (uintptr_t) vma->va) {
+            vma->len += (uintptr_t) vma->va - start;
+            vma->va = (void *) start;
+        }
+    }
+
+    // Stay inside the VMA and the page table
+    if (start < (uintptr_t) vma->va) {
+        start = (uintptr_t) vma->va;
+    }
+    if (start < block) {
+        start = block;
+    }
+    if (end > vma_end) {
+        end = vma_end;
+    }
+    if (end > block + PAGE_TABLE_SPAN) {
+        end = block + PAGE_TABLE_SPAN;
+    }
+
+    // The page table is there already
+    if (end > start && !quota_fits(env, PAGE_INDEX(end - start), 0)) {
+        return;
+    }
+
+    for (vi = start; vi < end; vi += PAGE_SIZE) {
+        if (vi == va || (pt->entries[PAGE_TABLE_INDEX(vi)] & PAGE_PRESENT)) {
+            continue;
+        }
+        if (vma_load_page(env, vma, vi, write) < 0) {
+            end = vi;
+            break;
+        }
+    }
+
+    vma->fa_start = start;
+    vma->fa_end = end;
+    vma->fa_fault = va;
+}
+
+/**
+* Returns the first page after 'va' that is not mapped, looking at most
+* VMA_READAHEAD_MAX pages ahead and not past the end of the VMA.
+*/
+static uintptr_t vma_next_unmapped(struct env *env, struct vma *vma, uintptr_t va) {
+    uintptr_t vma_end = (uintptr_t) vma->va + vma->len;
+    uintptr_t end = MIN(vma_end, va + PAGE_SIZE + VMA_READAHEAD_MAX * PAGE_SIZE);
+    uintptr_t vi;
+
+    for (vi = va + PAGE_SIZE; vi < end; vi += PAGE_SIZE) {
+        if (page_lookup(env->env_pml4, (void *) vi, NULL) == NULL) {
+            break;
+        }
+    }
+    return vi;
+}
+
+/**
+* Maps pages ahead of the page at 'va' that was just loaded, if the VMA
+* is being read in ascending order, and around it otherwise (see
+* vma_fault_around).
+*
+* A fault is sequential if it hits the first page left unmapped after
+* the previous fault. Each sequential fault doubles the readahead window
+* (starting at VMA_READAHEAD_MIN, up to VMA_READAHEAD_MAX), so a stream
+* takes one fault per window. Any other fault halves it. Only anonymous
+* and binary VMAs read ahead, and not with random advice. Stops quietly
+* when running out of memory or when the window does not fit under the
+* soft memory limits.
+*/
+void vma_readahead(struct env *env, struct vma *vma, uintptr_t va, int write) {
+    uintptr_t vma_end = (uintptr_t) vma->va + vma->len;
+    uintptr_t end, vi;
+
+    if ((vma->type != VMA_ANON && vma->type != VMA_BINARY) ||
+        (vma->advice & VMA_ADV_RANDOM)) {
+        vma_fault_around(env, vma, va, write);
+        return;
+    }
+
+    if (va != vma->ra_next) {
+        vma->ra_pages /= 2;
+        vma_fault_around(env, vma, va, write);
+        vma->ra_next = vma_next_unmapped(env, vma, va);
+        return;
+    }
+
+    vma->ra_pages = MIN(MAX(vma->ra_pages * 2, VMA_READAHEAD_MIN), VMA_READAHEAD_MAX);
+    end = MIN(vma_end, va + PAGE_SIZE + vma->ra_pages * PAGE_SIZE);
+
+    if (quota_fits(env, vma->ra_pages,
+                   page_tables_missing(env->env_pml4, va + PAGE_SIZE, end, 0))) {
+        for (vi = va + PAGE_SIZE; vi < end; vi += PAGE_SIZE) {
+            if (page_lookup(env->env_pml4, (void *) vi, NULL) != NULL) {
                 continue;
             }
+            if (vma_load_page(env, vma, vi, write) < 0) {
+                break;
+            }
+        }
+    }
 
-            // PDP entry
-            pdp = (struct page_table *)KADDR(PAGE_ADDR(*entry));
+    vma->ra_next = vma_next_unmapped(env, vma, va);
+}
 
-            if (i == 0 || i == 1) {
-                entry = pdp->entries + PDPT_INDEX((uintptr_t) va);
-                if (!(*entry & PAGE_PRESENT)) {
-                    continue;
-                }
-                // Page dir entry
-                pd = (struct page_table *)KADDR(PAGE_ADDR(*entry));
-            }
+/**
+* Removes a present leaf entry and drops the page, for page_walk_range.
+* 'arg' is the memory accounting of the environment.
+*/
+static int vma_unmap_entry(physaddr_t *entry, uintptr_t va, void *arg) {
+    struct env_mem *mem = arg;
 
-            if (i == 0) {
-                entry = pd->entries + PAGE_DIR_INDEX((uintptr_t) va);
-                if (!(*entry & PAGE_PRESENT)) {
-                    continue;
-                }
-                // Page table
-                pt = (struct page_table *)KADDR(PAGE_ADDR(*entry));
-            }
-            
-            // Fix pointers for rest of the code
-            if (i == 1) {
-                pt = pd;
-            } else if (i == 2) {
-                pt = pdp;
+    if (*entry & PAGE_HUGE) {
+        mem->rss_huge--;
+    } else {
+        mem->rss_pages--;
+    }
+    page_decref(pa2page(PAGE_ADDR(*entry)));
+    *entry = 0;
+    return 0;
+}
+
+/* Returns 1 if no entry of the table is present. */
+static int vma_table_empty(struct page_table *table) {
+    size_t i;
+
+    for (i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        if (table->entries[i] & PAGE_PRESENT) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Frees the table an entry points to if it is empty, and clears the entry. */
+static void vma_free_table(struct env_mem *mem, physaddr_t *entry) {
+    if (vma_table_empty((struct page_table *)KADDR(PAGE_ADDR(*entry)))) {
+        page_decref(pa2page(PAGE_ADDR(*entry)));
+        *entry = 0;
+        mem->pt_pages--;
+    }
+}
+
+/**
+* Frees the page tables, page directories and page directory pointer
+* tables that cover part of <start, end) and have become empty.
+*/
+static void vma_free_tables(struct env *env, uintptr_t start, uintptr_t end) {
+    struct page_table *pml4 = env->env_pml4;
+    struct page_table *pdp, *pd;
+    physaddr_t *pml4e, *pdpe, *pde;
+    uintptr_t va_pdp, va_pd, va_pt;
+
+    for (va_pdp = ROUNDDOWN(start, PDPT_SPAN); va_pdp < end; va_pdp += PDPT_SPAN) {
+        pml4e = pml4->entries + PML4_INDEX(va_pdp);
+        if (!(*pml4e & PAGE_PRESENT)) {
+            continue;
+        }
+        pdp = (struct page_table *)KADDR(PAGE_ADDR(*pml4e));
+
+        va_pd = (va_pdp < start) ? ROUNDDOWN(start, PAGE_DIR_SPAN) : va_pdp;
+        for (; va_pd < end && va_pd < va_pdp + PDPT_SPAN; va_pd += PAGE_DIR_SPAN) {
+            pdpe = pdp->entries + PDPT_INDEX(va_pd);
+            if (!(*pdpe & PAGE_PRESENT)) {
+                continue;
             }
+            pd = (struct page_table *)KADDR(PAGE_ADDR(*pdpe));
 
-            // Check the whole page table. If its empty, delete its entry in the page dir
-            for (i = 0; i < PAGE_TABLE_ENTRIES; i++) {
-                if (pt->entries[i] & PAGE_PRESENT) {
-                    is_empty = 0;
-                    break;
+            va_pt = (va_pd < start) ? ROUNDDOWN(start, PAGE_TABLE_SPAN) : va_pd;
+            for (; va_pt < end && va_pt < va_pd + PAGE_DIR_SPAN; va_pt += PAGE_TABLE_SPAN) {
+                pde = pd->entries + PAGE_DIR_INDEX(va_pt);
+                if ((*pde & PAGE_PRESENT) && !(*pde & PAGE_HUGE)) {
+                    vma_free_table(&env->env_mem, pde);
                 }
             }
 
-            // Clear the entry and fix the higher level table entry
-            if (is_empty) {
-                page = pa2page(PAGE_ADDR(*entry));
-                page_decref(page);
-                *entry = 0;
-                tlb_invalidate(env->env_pml4, entry);
-            }
+            vma_free_table(&env->env_mem, pdpe);
         }
+
+        vma_free_table(&env->env_mem, pml4e);
     }
 }
 
+/**
+* Unmaps the given range of virtual addresses from the environment
+* page tables, destroys page tables / page directories / page directory
+* pointers that become empty and frees physical pages if necessary.
+* The TLB is flushed once for the whole range at the end.
+* Assume aligned addresses, and no huge page straddling the edges
+* of the range (see vma_demote_edges).
+*/
+void vma_unmap(uintptr_t va, size_t size, struct env *env) {
+    // Remove and unmap the actual entries
+    page_walk_range(env->env_pml4, va, va + size, vma_unmap_entry, &env->env_mem);
+
+    // Remove page tables, then page dir tables, then page dir pointer tables
+    vma_free_tables(env, va, va + size);
+
+    tlb_invalidate_range(env->env_pml4, va, va + size);
+}
+
+struct vma_reclaim_args {
+    struct env *env;
+    struct vma *vma;
+    size_t target;
+    size_t done;
+    int referenced;     // Also take pages accessed since the last pass
+};
+
+/**
+* Drops a page that faults back in unchanged, for page_walk_range: the
+* shared zero pages, and pages of binary VMAs still mapped to the frame
+* of the binary in the kernel image. Written or copied pages are kept,
+* whatever the bits of the entry say.
+* Unless args->referenced, recently accessed pages get a second chance:
+* their accessed bit is cleared instead.
+*/
+static int vma_reclaim_entry(physaddr_t *entry, uintptr_t va, void *arg) {
+    struct vma_reclaim_args *args = arg;
+    struct page_info *page = pa2page(PAGE_ADDR(*entry));
+
+    if (page != zero_page && page != zero_huge_page &&
+        page != vma_binary_frame(args->vma, va)) {
+        return 0;
+    }
+
+    if (!args->referenced && (*entry & PAGE_ACCESSED)) {
+        *entry &= ~(physaddr_t) PAGE_ACCESSED;
+        return 0;
+    }
+
+    args->done += (*entry & PAGE_HUGE) ? SMALL_PAGES_IN_HUGE : 1;
+    vma_unmap_entry(entry, va, &args->env->env_mem);
+    return args->done >= args->target;
+}
+
+/**
+* Unmaps up to 'target' pages of the environment that can be faulted
+* back in unchanged (see vma_reclaim_entry), to bring it back under its
+* memory limits. Pages that were not accessed recently go first. Page
+* tables that become empty are freed.
+*
+* Returns the number of pages unmapped.
+*/
+size_t vma_reclaim(struct env *env, size_t target) {
+    struct vma_reclaim_args args = { env, NULL, target, 0, 0 };
+    uintptr_t start, end;
+    struct vma *vma;
+
+    for (; args.referenced < 2 && args.done < target; args.referenced++) {
+        for (vma = env->vma;
+             vma != NULL && vma->type != VMA_UNUSED && args.done < target;
+             vma = vma->next) {
+            start = (uintptr_t) vma->va;
+            end = start + vma->len;
+            args.vma = vma;
+
+            page_walk_range(env->env_pml4, start, end, vma_reclaim_entry, &args);
+            vma_free_tables(env, start, end);
+            tlb_invalidate_range(env->env_pml4, start, end);
+        }
+    }
+
+    return args.done;
+}
+
 /**
 * Returns a pointer to the last VMA from the VMAs list.
 * It does not matter if its free or not.
@@ -1,12 +1,40 @@
+#pragma once
+
 #include <kern/env.h>
 #include <inc/env.h>
 #include <kern/pmap.h>
 
+/* Default and smallest fault-around window, in pages. */
+#define VMA_FAULT_AROUND_PAGES 16
+#define VMA_FAULT_AROUND_MIN 2
+
+/* Smallest and largest sequential readahead window, in pages. */
+#define VMA_READAHEAD_MIN 4
+#define VMA_READAHEAD_MAX 256
+
 struct vma *vma_lookup(struct env *env, void *va);
 struct vma *vma_insert(struct env *env, int type, void *mem_va, size_t mem_size,
     int perm, void *file_va, uint64_t file_size);
-uintptr_t vma_get_vmem(size_t size, struct vma *vma);
-void vma_map_populate(uintptr_t va, size_t size, int perm, struct env *env);
+struct vma *vma_insert_stack(struct env *env, uintptr_t top);
+struct vma *vma_stack_grow(struct env *env, uintptr_t va);
+uintptr_t vma_get_vmem(size_t size, size_t align, struct vma *vma);
+int vma_range_free(struct env *env, uintptr_t start, uintptr_t end);
+int vma_map_populate(uintptr_t va, size_t size, int perm, struct env *env);
 void vma_unmap(uintptr_t va, size_t size, struct env *env);
+size_t vma_reclaim(struct env *env, size_t target);
 struct vma *vma_get_last(struct vma *vma);
-void vma_make_unused(struct env *env, struct vma *vma);
\ No newline at end of file
+void vma_make_unused(struct env *env, struct vma *vma);
+struct vma *vma_merge(struct env *env, struct vma *vma);
+struct vma *vma_split(struct env *env, struct vma *vma, uintptr_t addr);
+int vma_split_range(struct env *env, uintptr_t start, uintptr_t end);
+void vma_merge_range(struct env *env, uintptr_t start, uintptr_t end);
+int vma_range_mapped(struct env *env, uintptr_t start, uintptr_t end);
+int vma_demote_edges(struct env *env, uintptr_t start, uintptr_t end);
+struct vma *vma_move(struct env *env, struct vma *vma, uintptr_t new_va,
+    size_t new_len);
+int vma_shared_perm(int perm);
+int vma_load_page(struct env *env, struct vma *vma, uintptr_t va, int write);
+int vma_cow_page(struct env *env, struct vma *vma, uintptr_t va);
+int vma_fork(struct env *parent, struct env *child);
+void vma_fault_around(struct env *env, struct vma *vma, uintptr_t va, int write);
+void vma_readahead(struct env *env, struct vma *vma, uintptr_t va, int write);
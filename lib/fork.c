@@ -0,0 +1,23 @@
+/* Implements fork on top of the sys_fork system call. */
+
+#include <inc/lib.h>
+
+/*
+ * Creates a child environment that runs a copy of the calling one.
+ * The kernel shares all pages copy-on-write between the two (see
+ * vma_fork), so this only has to fix up 'thisenv' in the child.
+ *
+ * Returns the envid of the child to the parent, 0 to the child,
+ * < 0 on error.
+ */
+envid_t fork(void)
+{
+    envid_t envid;
+
+    envid = sys_fork();
+    if (envid == 0) {
+        thisenv = vdso_thisenv();
+    }
+
+    return envid;
+}
@@ -20,19 +20,10 @@ const char *binaryname = "<unknown>";
 
 void libmain(int argc, char **argv)
 {
-    const volatile struct env *e;
-    envid_t env_id = sys_getenvid();
+    /* The kernel data page knows where we are in envs. */
+    thisenv = vdso_thisenv();
 
-    thisenv = NULL;
-
-    for (e = envs; e < envs + NENV; ++e) {
-        if (e->env_id == env_id) {
-            thisenv = e;
-            break;
-        }
-    }
-
-    assert(thisenv);
+    assert(thisenv && thisenv->env_id == vdso_getenvid());
 
     /* Save the name of the program so that panic() can use it. */
     if (argc > 0)
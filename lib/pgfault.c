@@ -0,0 +1,35 @@
+/*
+ * User-level page fault handler support.
+ * Install a C page fault handler with set_pgfault_handler(); the kernel then
+ * delivers page faults it could not resolve, and all faults in ranges
+ * advised with MADV_USERFAULT, to the assembly entry point _pgfault_upcall
+ * in pfentry.S, which calls the handler and resumes the faulting code.
+ */
+
+#include <inc/lib.h>
+
+/* Assembly language page fault entry point (in lib/pfentry.S). */
+extern void _pgfault_upcall(void);
+
+/* Pointer to the currently installed C page fault handler. */
+void (*_pgfault_handler)(struct user_frame *uf);
+
+/*
+ * Set the page fault handler function.
+ * The first time, register the assembly entry point with the kernel, which
+ * maps the exception stack along with it. The handler runs on the exception
+ * stack and must return to resume the faulting instruction.
+ */
+void set_pgfault_handler(void (*handler)(struct user_frame *uf))
+{
+    int r;
+
+    if (_pgfault_handler == NULL) {
+        r = sys_env_set_pgfault_upcall(0, _pgfault_upcall);
+        if (r < 0) {
+            panic("set_pgfault_handler: %e", r);
+        }
+    }
+
+    _pgfault_handler = handler;
+}
@@ -0,0 +1,101 @@
+#include <inc/ring.h>
+#include <inc/string.h>
+
+/*
+ * Sets up an empty ring in the 'len' bytes of memory at 'mem'. The data
+ * area gets the largest power of two size that fits.
+ * Returns the ring, or NULL if the memory is too small.
+ */
+struct ring *ring_init(void *mem, size_t len)
+{
+    struct ring *ring = mem;
+    size_t size = 1;
+
+    if (len <= sizeof(struct ring))
+        return NULL;
+
+    len -= sizeof(struct ring);
+    while (size <= len / 2)
+        size *= 2;
+
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+
+    // The other side only looks at the ring once the magic is there
+    __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+/*
+ * Returns the ring set up by ring_init at 'mem', possibly by another
+ * environment, or NULL if there is none (yet).
+ */
+struct ring *ring_attach(void *mem)
+{
+    struct ring *ring = mem;
+
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC)
+        return NULL;
+
+    return ring;
+}
+
+/* Returns the number of bytes that can be read. */
+size_t ring_used(struct ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Returns the number of bytes that can be written. */
+size_t ring_free(struct ring *ring)
+{
+    return ring->size - ring_used(ring);
+}
+
+/*
+ * Producer side: copies up to 'len' bytes from 'buf' into the ring.
+ * Returns the number of bytes written, 0 if the ring is full.
+ */
+size_t ring_write(struct ring *ring, const void *buf, size_t len)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t off, chunk;
+
+    len = MIN(len, ring->size - (head - tail));
+    off = head & (ring->size - 1);
+    chunk = MIN(len, ring->size - off);
+
+    // The free space may wrap around the end of the data area
+    memcpy(ring->data + off, buf, chunk);
+    memcpy(ring->data, (const uint8_t *) buf + chunk, len - chunk);
+
+    // Publish the data before the new head
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/*
+ * Consumer side: copies up to 'len' bytes from the ring into 'buf'.
+ * Returns the number of bytes read, 0 if the ring is empty.
+ */
+size_t ring_read(struct ring *ring, void *buf, size_t len)
+{
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t off, chunk;
+
+    len = MIN(len, head - tail);
+    off = tail & (ring->size - 1);
+    chunk = MIN(len, ring->size - off);
+
+    // The data may wrap around the end of the data area
+    memcpy(buf, ring->data + off, chunk);
+    memcpy((uint8_t *) buf + chunk, ring->data, len - chunk);
+
+    // Only then hand the space back to the producer
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
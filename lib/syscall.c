@@ -59,8 +59,71 @@ void *sys_vma_create(size_t size, int perm, int flags)
     return (void *) syscall(SYS_vma_create, 1, size, perm, flags, 0, 0);
 }
 
+void *sys_vma_create_at(void *addr, size_t size, int perm, int flags, size_t align)
+{
+    return (void *) syscall(SYS_vma_create, 0, size, perm, flags,
+        (unsigned long) addr, align);
+}
+
 int sys_vma_destroy(void *va, size_t size)
 {
     /* LAB 4: Your code here */
-    return syscall(SYS_vma_destroy, 1, (unsigned long) va, size, 0, 0, 0);
+    return syscall(SYS_vma_destroy, 0, (unsigned long) va, size, 0, 0, 0);
+}
+
+int sys_vma_protect(void *va, size_t size, int perm)
+{
+    return syscall(SYS_vma_protect, 0, (unsigned long) va, size, perm, 0, 0);
+}
+
+int sys_vma_advise(void *va, size_t size, int advice)
+{
+    return syscall(SYS_vma_advise, 0, (unsigned long) va, size, advice, 0, 0);
+}
+
+int sys_vma_fault_around(void *va, size_t size, int npages)
+{
+    return syscall(SYS_vma_fault_around, 0, (unsigned long) va, size, npages, 0, 0);
+}
+
+void *sys_vma_remap(void *old_va, size_t old_len, size_t new_len, int flags)
+{
+    return (void *) syscall(SYS_vma_remap, 0, (unsigned long) old_va, old_len,
+        new_len, flags, 0);
+}
+
+int sys_vma_share(envid_t envid, void *va, size_t len, int perm)
+{
+    return syscall(SYS_vma_share, 0, envid, (unsigned long) va, len, perm, 0);
+}
+
+int sys_mem_limit(envid_t envid, int resource, size_t soft, size_t hard)
+{
+    return syscall(SYS_mem_limit, 0, envid, resource, soft, hard, 0);
+}
+
+int sys_mem_group(envid_t envid, uint32_t group)
+{
+    return syscall(SYS_mem_group, 0, envid, group, 0, 0, 0);
+}
+
+int sys_mem_group_limit(uint32_t group, int resource, size_t soft, size_t hard)
+{
+    return syscall(SYS_mem_group_limit, 0, group, resource, soft, hard, 0);
+}
+
+int sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
+{
+    return syscall(SYS_env_set_pgfault_upcall, 0, envid, (unsigned long) upcall,
+        0, 0, 0);
+}
+
+envid_t sys_fork(void)
+{
+    return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+void sys_yield(void)
+{
+    syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
 }
@@ -0,0 +1,41 @@
+/*
+ * Queries answered from the kernel data pages mapped read-only into every
+ * environment (see inc/vdso.h), without entering the kernel.
+ */
+
+#include <inc/lib.h>
+#include <inc/vdso.h>
+
+#include <inc/x86-64/asm.h>
+
+const volatile struct vdso_env *vdso = (struct vdso_env *)USER_VDSO;
+
+/* Returns the envid of the calling environment, like sys_getenvid. */
+envid_t vdso_getenvid(void)
+{
+    return vdso->env_id;
+}
+
+/* Returns the calling environment in envs. */
+const volatile struct env *vdso_thisenv(void)
+{
+    return vdso->env;
+}
+
+/* Returns the TSC frequency in cycles per second, 0 if unknown. */
+uint64_t vdso_tsc_hz(void)
+{
+    return vdso->global->tsc_hz;
+}
+
+/* Returns the milliseconds since the kernel was done booting, 0 if the
+ * TSC frequency is unknown. */
+uint64_t vdso_uptime_ms(void)
+{
+    uint64_t hz = vdso->global->tsc_hz;
+
+    if (hz < 1000) {
+        return 0;
+    }
+    return (read_tsc() - vdso->global->boot_tsc) / (hz / 1000);
+}